@@ -17,6 +17,8 @@
 #include <lol/engine.h>
 
 #include <string>
+#include <string_view>
+#include <algorithm>
 #include <regex>
 
 #include <tao/pegtl.hpp>
@@ -83,11 +85,232 @@ struct query_at_sol
     }
 };
 
+//
+// Lexical rules for code statistics. They are built from the rules of
+// the grammar, so that comments, strings, numbers, names and keywords are
+// recognised exactly as when parsing, but no parse tree is built, so that
+// counting stays a single linear pass over the code.
+//
+
+// Rules that raise a global error on malformed input, e.g. “0x” or an
+// unterminated string, just fail here; the characters are then counted
+// as operators.
+struct token_number : pegtl::seq< pegtl::at< pegtl::sor< pegtl::digit,
+                                                         pegtl::seq< pegtl::one< '.' >, pegtl::digit > > >,
+                                  pegtl::try_catch< numeral > > {};
+struct token_string : pegtl::try_catch< literal_string > {};
+
+// Newer PICO-8 operators that the grammar does not handle yet
+struct token_op_long : pegtl::sor< pegtl::string< '>', '>', '>', '=' >,
+                                   pegtl::string< '<', '<', '>', '=' >,
+                                   pegtl::string< '>', '>', '<', '=' > > {};
+struct token_op_three : pegtl::sor< pegtl::string< '.', '.', '=' >,
+                                    pegtl::string< '>', '>', '>' >,
+                                    pegtl::string< '<', '<', '>' >,
+                                    pegtl::string< '>', '>', '<' >,
+                                    pegtl::string< '>', '>', '=' >,
+                                    pegtl::string< '<', '<', '=' >,
+                                    pegtl::string< '^', '^', '=' > > {};
+struct token_op_two : pegtl::sor< pegtl::string< '^', '^' >,
+                                  pegtl::string< '^', '=' >,
+                                  pegtl::string< '|', '=' >,
+                                  pegtl::string< '&', '=' >,
+                                  pegtl::string< '\\', '=' > > {};
+
+// Longest operators first; anything else is a single character operator
+struct token_op : pegtl::sor< token_op_long,
+                              three_dots,
+                              token_op_three,
+                              pegtl::two< '.' >,
+                              pegtl::two< ':' >,
+                              operators_six,
+                              operators_two,
+                              reassign_op,
+                              token_op_two,
+                              pegtl::any > {};
+
+struct token_stream : pegtl::until< pegtl::eof,
+                                    pegtl::sor< sep_normal, token_number, token_string,
+                                                keyword, name, token_op > > {};
+
+// A shorthand “if (cond) statement” has neither “then” nor “end”; this
+// is the same test as in the grammar. In the “if (cond) do” form, the
+// “end” closes the “do” block.
+struct shorthand_if : pegtl::try_catch< not_at_if_then > {};
+
 } // namespace lua53
 
 namespace z8
 {
 
+namespace
+{
+
+enum class lex { name, keyword, number, string, op };
+
+struct lexeme
+{
+    lex type;
+    std::string_view text;
+    int line;
+    // For “if” keywords, whether this is a shorthand if
+    bool shorthand;
+};
+
+// The grammar rules take the analyzer as their state
+struct lexer : analyzer
+{
+    char const *end;
+    std::vector<lexeme> lexemes;
+};
+
+template<typename R> struct lex_action : pegtl::nothing<R> {};
+
+template<lex T>
+struct lex_push
+{
+    template<typename Input>
+    static void apply(Input const &in, lexer &l)
+    {
+        l.lexemes.push_back(lexeme { T, std::string_view(in.begin(), in.size()),
+                                     (int)in.position().line, false });
+    }
+};
+
+template<> struct lex_action<lua53::name> : lex_push<lex::name> {};
+template<> struct lex_action<lua53::token_number> : lex_push<lex::number> {};
+template<> struct lex_action<lua53::token_string> : lex_push<lex::string> {};
+template<> struct lex_action<lua53::token_op> : lex_push<lex::op> {};
+
+template<>
+struct lex_action<lua53::keyword>
+{
+    template<typename Input>
+    static void apply(Input const &in, lexer &l)
+    {
+        lex_push<lex::keyword>::apply(in, l);
+
+        auto &k = l.lexemes.back();
+        if (k.text == "if")
+        {
+            pegtl::memory_input<> rest(in.end(), l.end, "if");
+            k.shorthand = pegtl::parse<lua53::shorthand_if>(rest, l);
+        }
+    }
+};
+
+} // anonymous namespace
+
+analyzer::code_info analyzer::count(std::string const &code)
+{
+    code_info ret;
+    ret.chars = (int)code.size();
+
+    lexer lx;
+    lx.end = code.data() + code.size();
+    pegtl::memory_input<> in(code.data(), code.size(), "code");
+    pegtl::parse<lua53::token_stream, lex_action>(in, lx);
+
+    auto const &lexemes = lx.lexemes;
+    size_t const n = lexemes.size();
+
+    auto is = [&](size_t k, lex type, char const *text)
+    {
+        return k < n && lexemes[k].type == type && lexemes[k].text == text;
+    };
+
+    // Whether the lexeme at k ends an expression, which tells a binary
+    // minus from a unary one
+    auto ends_value = [&](size_t k)
+    {
+        auto const &l = lexemes[k];
+        switch (l.type)
+        {
+        case lex::name: case lex::number: case lex::string:
+            return true;
+        case lex::keyword:
+            return l.text == "nil" || l.text == "true" || l.text == "false" || l.text == "end";
+        default:
+            return l.text == ")" || l.text == "]" || l.text == "}" || l.text == "...";
+        }
+    };
+
+    // The PICO-8 rules: brackets count once per pair, strings and
+    // negative literals count as one token, and some separators and
+    // keywords are free.
+    auto cost = [&](size_t k)
+    {
+        auto const &l = lexemes[k];
+        if (l.type == lex::keyword)
+            return l.text == "end" || l.text == "local" ? 0 : 1;
+        if (l.type != lex::op)
+            return 1;
+        if (l.text == "," || l.text == "." || l.text == ":" || l.text == ";"
+             || l.text == "::" || l.text == ")" || l.text == "]" || l.text == "}")
+            return 0;
+        if (l.text == "-" && k + 1 < n && lexemes[k + 1].type == lex::number
+             && (k == 0 || !ends_value(k - 1)))
+            return 0;
+        return 1;
+    };
+
+    // Blocks closed by “end”; function blocks remember their index in
+    // ret.functions and the token count at their start.
+    struct block { int function, start; };
+    std::vector<block> blocks;
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        auto const &l = lexemes[k];
+        ret.tokens += cost(k);
+
+        if (l.type != lex::keyword)
+            continue;
+
+        if (l.text == "function")
+        {
+            // “function a.b:c()”, “local function f()” or “f = function()”
+            std::string name;
+            for (size_t j = k + 1; j < n && lexemes[j].type == lex::name; j += 2)
+            {
+                name += lexemes[j].text;
+                if (!is(j + 1, lex::op, ".") && !is(j + 1, lex::op, ":"))
+                    break;
+                name += lexemes[j + 1].text;
+            }
+            if (name.empty() && k >= 2 && is(k - 1, lex::op, "=")
+                 && lexemes[k - 2].type == lex::name)
+                name = lexemes[k - 2].text;
+            if (name.empty())
+                name = "<anonymous>";
+
+            blocks.push_back(block { (int)ret.functions.size(), ret.tokens - 1 });
+            ret.functions.push_back(function_info { name, l.line, 0 });
+        }
+        else if (l.text == "do" || (l.text == "if" && !l.shorthand))
+        {
+            blocks.push_back(block { -1, 0 });
+        }
+        else if (l.text == "end" && blocks.size())
+        {
+            if (blocks.back().function >= 0)
+                ret.functions[blocks.back().function].tokens = ret.tokens - blocks.back().start;
+            blocks.pop_back();
+        }
+    }
+
+    // Unterminated functions get whatever they had
+    for (auto const &b : blocks)
+        if (b.function >= 0)
+            ret.functions[b.function].tokens = ret.tokens - b.start;
+
+    std::stable_sort(ret.functions.begin(), ret.functions.end(),
+                     [](function_info const &a, function_info const &b)
+                     { return a.tokens > b.tokens; });
+
+    return ret;
+}
+
 std::string analyzer::fix(std::string const &code)
 {
     /* PNG carts have a “if(_update60)_update…” code snippet added by PICO-8
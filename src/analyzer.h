@@ -15,13 +15,15 @@
 #include <lol/engine.h>
 
 #include <string>
+#include <vector>
 
 // The analyzer class
 // ——————————————————
 // This class used to parse and rewrite the PICO-8 code and transcribe it to
 // regular Lua code. Now that we use z8lua instead of Lua, this is no longer
 // required, and the fix() function just adds some backwards compatibility
-// glue code to the source.
+// glue code to the source. The count() function computes code statistics
+// such as the PICO-8 token count, using the lexical rules of the grammar.
 
 namespace z8
 {
@@ -29,8 +31,23 @@ namespace z8
 class analyzer
 {
 public:
+    struct function_info
+    {
+        std::string name;
+        int line, tokens;
+    };
+
+    struct code_info
+    {
+        int chars = 0, tokens = 0;
+        // Sorted by decreasing token count
+        std::vector<function_info> functions;
+    };
+
     std::string fix(std::string const &str);
 
+    static code_info count(std::string const &code);
+
     int m_disable_crlf = 0;
 };
 
@@ -0,0 +1,143 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include "audio_stats.h"
+
+namespace z8
+{
+
+// There is only one writer, so a relaxed load and store is enough
+static inline void add(std::atomic<uint64_t> &counter, uint64_t x)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + x,
+                  std::memory_order_relaxed);
+}
+
+// Maxima are also reset by the reader, hence the compare-exchange
+static inline void update_max(std::atomic<uint64_t> &counter, uint64_t x)
+{
+    uint64_t old = counter.load(std::memory_order_relaxed);
+    while (x > old && !counter.compare_exchange_weak(old, x, std::memory_order_relaxed))
+        ;
+}
+
+void audio_monitor::begin(int samples, int rate)
+{
+    m_start = clock::now();
+
+    if (m_expected_us >= 0 && m_paced.load(std::memory_order_relaxed))
+    {
+        int64_t interval = std::chrono::duration_cast<std::chrono::microseconds>(m_start - m_last).count();
+        uint64_t jitter = (uint64_t)std::abs(interval - m_expected_us);
+
+        add(m_interval_us, (uint64_t)interval);
+        add(m_jitter_us, jitter);
+        update_max(m_max_interval_us, (uint64_t)interval);
+        update_max(m_max_jitter_us, jitter);
+
+        if (2 * interval > 3 * m_expected_us)
+            add(m_late, 1);
+    }
+
+    m_last = m_start;
+    m_expected_us = rate > 0 ? (int64_t)samples * 1000000 / rate : 0;
+
+    add(m_callbacks, 1);
+    add(m_samples, (uint64_t)samples);
+    m_buffer_size.store(samples, std::memory_order_relaxed);
+    m_rate.store(rate, std::memory_order_relaxed);
+}
+
+void audio_monitor::end()
+{
+    int64_t synth = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - m_start).count();
+
+    add(m_synth_us, (uint64_t)synth);
+    update_max(m_max_synth_us, (uint64_t)synth);
+
+    if (synth > m_expected_us)
+        add(m_slow_synths, 1);
+}
+
+audio_stats audio_monitor::get() const
+{
+    audio_stats ret;
+    ret.callbacks = m_callbacks.load(std::memory_order_relaxed);
+    ret.samples = m_samples.load(std::memory_order_relaxed);
+    ret.late = m_late.load(std::memory_order_relaxed);
+    ret.slow_synths = m_slow_synths.load(std::memory_order_relaxed);
+    ret.buffer_size = m_buffer_size.load(std::memory_order_relaxed);
+    ret.rate = m_rate.load(std::memory_order_relaxed);
+    ret.interval_us = m_interval_us.load(std::memory_order_relaxed);
+    ret.jitter_us = m_jitter_us.load(std::memory_order_relaxed);
+    ret.synth_us = m_synth_us.load(std::memory_order_relaxed);
+    ret.max_interval_us = m_max_interval_us.load(std::memory_order_relaxed);
+    ret.max_jitter_us = m_max_jitter_us.load(std::memory_order_relaxed);
+    ret.max_synth_us = m_max_synth_us.load(std::memory_order_relaxed);
+    ret.paced = m_paced.load(std::memory_order_relaxed);
+    return ret;
+}
+
+audio_stats audio_monitor::next_period()
+{
+    audio_stats ret = get();
+    ret.max_interval_us = m_max_interval_us.exchange(0, std::memory_order_relaxed);
+    ret.max_jitter_us = m_max_jitter_us.exchange(0, std::memory_order_relaxed);
+    ret.max_synth_us = m_max_synth_us.exchange(0, std::memory_order_relaxed);
+    return ret;
+}
+
+std::string audio_stats::report() const
+{
+    return report(audio_stats());
+}
+
+std::string audio_stats::report(audio_stats const &since) const
+{
+    uint64_t const n = callbacks - since.callbacks;
+    if (n == 0)
+        return "audio: no callbacks";
+
+    // The first callback has no interval, hence n - 1 intervals at most
+    double const intervals = (double)lol::max(uint64_t(1), n - (since.callbacks ? 0 : 1));
+    double const synth_ms = (synth_us - since.synth_us) / 1000.0;
+    double const total_ms = (interval_us - since.interval_us) / 1000.0;
+
+    // Without a real-time device, only the synthesis cost is meaningful
+    if (!paced)
+        return lol::format("audio: %d callbacks of %d samples at %d Hz, "
+                           "synth %.3fms (max %.3fms), %d slow",
+                           (int)n, buffer_size, rate,
+                           synth_ms / n, max_synth_us / 1000.0,
+                           (int)(slow_synths - since.slow_synths));
+
+    return lol::format("audio: %d callbacks of %d samples at %d Hz, "
+                       "interval %.2fms ±%.2fms (max %.2fms), "
+                       "synth %.3fms (max %.3fms, %.1f%% CPU), "
+                       "%d late, %d slow",
+                       (int)n, buffer_size, rate,
+                       total_ms / intervals,
+                       (jitter_us - since.jitter_us) / 1000.0 / intervals,
+                       max_interval_us / 1000.0,
+                       synth_ms / n, max_synth_us / 1000.0,
+                       total_ms > 0 ? 100.0 * synth_ms / total_ms : 0.0,
+                       (int)(late - since.late), (int)(slow_synths - since.slow_synths));
+}
+
+} // namespace z8
+
@@ -0,0 +1,90 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+// The audio_monitor class
+// ———————————————————————
+// Collects timing statistics about an audio streaming callback: how often
+// it is called, how regularly, and how long it takes to fill its buffer.
+// A callback is “late” when it comes more than 50% later than the length
+// of the previous buffer, and synthesis is “slow” when it took longer
+// than the buffer lasts. A slow synthesis is likely, but not certain, to
+// cause a device underrun, depending on how much the device buffers.
+//
+// Intervals, jitter and late callbacks only make sense when a real-time
+// device pulls the audio. Callers that pull samples as fast as they can,
+// such as headless runs, should call set_paced(false).
+//
+// Counters are only written by the audio thread and may be read at any
+// time from another thread; totals are cumulative, so periodic reports
+// should diff two snapshots. Maxima are reset by next_period() instead.
+
+namespace z8
+{
+
+struct audio_stats
+{
+    uint64_t callbacks = 0, samples = 0;
+    uint64_t late = 0, slow_synths = 0;
+    int buffer_size = 0, rate = 0;
+    bool paced = true;
+
+    // Cumulative and maximum timings, in microseconds. Jitter is the
+    // absolute difference between a callback interval and the duration
+    // of the previous buffer.
+    uint64_t interval_us = 0, jitter_us = 0, synth_us = 0;
+    uint64_t max_interval_us = 0, max_jitter_us = 0, max_synth_us = 0;
+
+    // One-line report of everything, or of what happened since a
+    // previous snapshot; maxima are those of the snapshot itself
+    std::string report() const;
+    std::string report(audio_stats const &since) const;
+};
+
+class audio_monitor
+{
+public:
+    // Call at the start and at the end of each callback
+    void begin(int samples, int rate);
+    void end();
+
+    // Whether a real-time device pulls the audio
+    void set_paced(bool paced) { m_paced.store(paced, std::memory_order_relaxed); }
+
+    audio_stats get() const;
+
+    // Same as get(), but also start a new period for the maxima
+    audio_stats next_period();
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    // Only accessed by the audio thread
+    clock::time_point m_start, m_last;
+    int64_t m_expected_us = -1;
+
+    std::atomic<uint64_t> m_callbacks { 0 }, m_samples { 0 };
+    std::atomic<uint64_t> m_late { 0 }, m_slow_synths { 0 };
+    std::atomic<int> m_buffer_size { 0 }, m_rate { 0 };
+    std::atomic<bool> m_paced { true };
+    std::atomic<uint64_t> m_interval_us { 0 }, m_jitter_us { 0 }, m_synth_us { 0 };
+    std::atomic<uint64_t> m_max_interval_us { 0 }, m_max_jitter_us { 0 }, m_max_synth_us { 0 };
+};
+
+} // namespace z8
+
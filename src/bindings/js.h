@@ -17,6 +17,8 @@
 #include <lol/engine.h>
 
 #include <optional>
+#include <memory>
+#include <vector>
 
 extern "C" {
 #include "3rdparty/quickjs/quickjs.h"
@@ -73,12 +75,14 @@ public:
     {
         JS_SetContextOpaque(ctx, that);
 
-        // FIXME: this should not be static, store it in "that" instead!
-        static auto lib = typename T::template api<js>().data;
+        // QuickJS keeps pointers to the function list and instantiates
+        // the functions lazily, so the list must live as long as “that”.
+        auto lib = std::make_shared<std::vector<bind_desc>>(typename T::template api<js>().data);
+        that->m_js_lib = lib;
 
         // Add functions to global scope
         auto global_obj = JS_GetGlobalObject(ctx);
-        JS_SetPropertyFunctionList(ctx, global_obj, lib.data(), (int)lib.size());
+        JS_SetPropertyFunctionList(ctx, global_obj, lib->data(), (int)lib->size());
         JS_FreeValue(ctx, global_obj);
     }
 
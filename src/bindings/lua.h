@@ -16,6 +16,7 @@
 
 #include <lol/engine.h>
 
+#include <atomic>
 #include <optional>
 #include <variant>
 
@@ -23,6 +24,8 @@
 #include "z8lua/lauxlib.h"
 #include "z8lua/lualib.h"
 
+#include "trace.h"
+
 namespace z8::bindings
 {
 
@@ -113,9 +116,14 @@ public:
     {
         static int wrap(lua_State *l)
         {
-            return dispatch(l, FN, make_seq(FN));
+            char const *str = name.load(std::memory_order_relaxed);
+            Z8_TRACE_SCOPE(str);
+            return dispatch(l, FN, make_seq(FN), str);
         }
 
+        // The Lua name of the function, for the profiler and the trace
+        static inline std::atomic<char const *> name { "api" };
+
         // Create an index sequence from a member function’s signature
         template<typename T, typename R, typename... A>
         static constexpr auto make_seq(R (T::*)(A...))
@@ -133,7 +141,9 @@ public:
         template<auto FN>
         bind_desc(char const *str, bind<FN> b)
           : luaL_Reg({ str, &b.wrap })
-        {}
+        {
+            bind<FN>::name.store(str, std::memory_order_relaxed);
+        }
     };
 
 private:
@@ -141,7 +151,7 @@ private:
     // and push the result to the Lua stack.
     template<typename T, typename R, typename... A, size_t... IS>
     static inline int dispatch(lua_State *l, R (T::*f)(A...),
-                               std::index_sequence<IS...>)
+                               std::index_sequence<IS...>, char const *name)
     {
         // Retrieve “this” from the Lua state.
     #if HAVE_LUA_GETEXTRASPACE
@@ -154,13 +164,28 @@ private:
 
         // Store this for API functions that we don’t know yet how to wrap
         that->m_sandbox_lua = l;
+        ++that->m_stats.api_calls;
 
         // Call the API function with the loaded arguments. Some specialization
         // is needed when the wrapped function returns void.
-        if constexpr (std::is_same<R, void>::value)
-            return (that->*f)(lua_get<A>(l, IS + 1)...), 0;
-        else
-            return lua_push(l, (that->*f)(lua_get<A>(l, IS + 1)...));
+        auto call = [&]() -> int
+        {
+            if constexpr (std::is_same<R, void>::value)
+                return (that->*f)(lua_get<A>(l, IS + 1)...), 0;
+            else
+                return lua_push(l, (that->*f)(lua_get<A>(l, IS + 1)...));
+        };
+
+        // When profiling, charge the time spent here to the Lua caller
+        if (that->m_profiler)
+        {
+            auto start = that->m_profiler->now();
+            int ret = call();
+            that->m_profiler->api_call(l, name, start);
+            return ret;
+        }
+
+        return call();
     }
 };
 
@@ -0,0 +1,416 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <filesystem>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+
+#include "zepto8.h"
+#include "cart_index.h"
+#include "threadpool.h"
+#include "png.h"
+#include "pico8/cart.h"
+#include "pico8/pico8.h"
+
+namespace z8
+{
+
+namespace fs = std::filesystem;
+
+using lol::msg;
+using lol::ivec2;
+using lol::u8vec4;
+
+static char const index_magic[8] = { 'z', '8', 'i', 'n', 'd', 'e', 'x', '\0' };
+static uint32_t const index_version = 1;
+
+struct index_header
+{
+    char magic[8];
+    uint32_t version, count;
+    uint64_t strings_offset, strings_size;
+};
+
+static_assert(sizeof(index_header) % 8 == 0, "index entries must stay aligned");
+static_assert(sizeof(cart_index::entry) % 8 == 0, "index entries must stay aligned");
+
+// An entry with its strings, before they go into the string table
+struct index_record
+{
+    cart_index::entry e;
+    std::string path, title, author;
+};
+
+// Splore sheets are 8×4 carts, each a 128×128 label and 8 lines of text
+static ivec2 const sheet_size(8 * 128, 4 * (128 + 8));
+
+// Downsample a 128×128 image to a thumbnail, keeping the most common
+// colour of each 4×4 block. get(x, y) returns a palette index.
+template<typename T>
+static void make_thumb(uint8_t *thumb, T get)
+{
+    int const scale = 128 / cart_index::thumb_size;
+
+    for (int y = 0; y < cart_index::thumb_size; ++y)
+    for (int x = 0; x < cart_index::thumb_size; ++x)
+    {
+        int count[16] = {}, best = 0;
+        for (int dy = 0; dy < scale; ++dy)
+        for (int dx = 0; dx < scale; ++dx)
+            ++count[get(x * scale + dx, y * scale + dy) & 0xf];
+        for (int i = 1; i < 16; ++i)
+            if (count[i] > count[best])
+                best = i;
+
+        int n = y * cart_index::thumb_size + x;
+        thumb[n / 2] |= best << (4 * (n & 1));
+    }
+}
+
+// Carts traditionally start with two comment lines: title, then author
+static void parse_info(std::string const &code, std::string &title, std::string &author)
+{
+    std::string *dst[] = { &title, &author };
+    size_t pos = 0;
+    for (auto *s : dst)
+    {
+        if (pos >= code.size() || code.compare(pos, 2, "--") != 0)
+            return;
+
+        size_t eol = std::min(code.find('\n', pos), code.size());
+
+        size_t start = pos + 2;
+        while (start < eol && isspace((uint8_t)code[start]))
+            ++start;
+        size_t end = eol;
+        while (end > start && isspace((uint8_t)code[end - 1]))
+            --end;
+        *s = pico8::charset::pico8_to_utf8(code.substr(start, end - start));
+        pos = eol + 1;
+    }
+}
+
+static void index_sheet(ivec2 size, std::vector<u8vec4> const &pixels,
+                        index_record const &base, std::vector<index_record> &out)
+{
+    for (int cart = 0; cart < 32; ++cart)
+    {
+        int x0 = cart % 8 * 128, y0 = cart / 8 * (128 + 8);
+        auto pixel = [&](int x, int y) { return pixels[(y0 + y) * size.x + x0 + x]; };
+
+        index_record r = base;
+        r.e.slot = (uint16_t)cart;
+
+        // The text lines under each label, one character per pixel
+        std::string *dst[] = { &r.title, &r.author };
+        for (int line = 0; line < 2; ++line)
+            for (int x = 0; x < 128 && pixel(x, 128 + line).r; ++x)
+                *dst[line] += (char)pixel(x, 128 + line).r;
+
+        make_thumb(r.e.thumb, [&](int x, int y)
+        {
+            return pico8::palette::best_fast(pixel(x, y));
+        });
+
+        out.push_back(std::move(r));
+    }
+}
+
+static void index_file(std::string const &path, uint64_t mtime, uint64_t file_size,
+                       std::vector<index_record> const *old,
+                       std::vector<index_record> &out)
+{
+    // The same mapping is used for hashing, sheet detection and loading
+    auto file_ptr = std::make_shared<mapped_file>();
+    if (!file_ptr->open(path))
+        return;
+    mapped_file const &file = *file_ptr;
+
+    index_record base;
+    memset(&base.e, 0, sizeof(base.e));
+    base.path = path;
+    base.e.mtime = mtime;
+    base.e.file_size = file_size;
+    base.e.hash = fnv1a(file.data(), file.size());
+    base.e.slot = cart_index::no_slot;
+    base.e.format = (uint16_t)file.format();
+
+    // The file was touched but its contents are the same
+    if (old && old->size() && (*old)[0].e.hash == base.e.hash)
+    {
+        for (auto r : *old)
+        {
+            r.e.mtime = mtime;
+            r.e.file_size = file_size;
+            out.push_back(std::move(r));
+        }
+        return;
+    }
+
+    // Splore sheets are PNG files with a specific size
+    ivec2 size;
+    if (file.format() == file_format::png
+         && png_size(file.data(), file.size(), size) && size == sheet_size)
+    {
+        std::vector<u8vec4> pixels;
+        if (!decode_png(file.data(), file.size(), size, pixels))
+        {
+            std::lock_guard<std::mutex> lock(image_lock());
+            lol::image img;
+            img.load(path);
+            size = img.size();
+            u8vec4 const *data = img.lock<lol::PixelFormat::RGBA_8>();
+            pixels.assign(data, data + size.x * size.y);
+            img.unlock(data);
+        }
+
+        if (size == sheet_size)
+        {
+            index_sheet(size, pixels, base, out);
+            return;
+        }
+    }
+
+    pico8::cart cart;
+    if (!cart.load(file_ptr))
+        return;
+
+    index_record r = std::move(base);
+    std::string const &code = cart.get_code();
+    parse_info(code, r.title, r.author);
+    r.e.code_size = (uint32_t)code.size();
+    r.e.compressed_size = (uint32_t)cart.get_compressed_code().size();
+
+    auto const &label = cart.get_label();
+    if (label.size() >= LABEL_WIDTH * LABEL_HEIGHT / 2)
+    {
+        make_thumb(r.e.thumb, [&](int x, int y)
+        {
+            return label[(y * LABEL_WIDTH + x) / 2] >> (4 * (x & 1));
+        });
+    }
+
+    out.push_back(std::move(r));
+}
+
+bool cart_index::open(std::string const &filename)
+{
+    m_entries = nullptr;
+    m_count = 0;
+    m_strings = nullptr;
+
+    if (!m_file.open(filename))
+        return false;
+
+    index_header h;
+    if (m_file.size() < sizeof(h))
+        return false;
+    memcpy(&h, m_file.data(), sizeof(h));
+
+    if (memcmp(h.magic, index_magic, sizeof(index_magic)) != 0
+         || h.version != index_version
+         || h.strings_offset < sizeof(h) + (uint64_t)h.count * sizeof(entry)
+         || h.strings_offset + h.strings_size > m_file.size()
+         || h.strings_size == 0
+         || m_file.data()[h.strings_offset + h.strings_size - 1] != '\0')
+    {
+        msg::error("invalid index file %s\n", filename.c_str());
+        m_file.close();
+        return false;
+    }
+
+    m_entries = (entry const *)(m_file.data() + sizeof(h));
+    m_count = h.count;
+    m_strings = (char const *)m_file.data() + h.strings_offset;
+
+    // Reject entries pointing outside the string table
+    for (size_t i = 0; i < m_count; ++i)
+    {
+        entry const &e = m_entries[i];
+        if (std::max({ e.path, e.title, e.author }) >= h.strings_size)
+        {
+            msg::error("corrupted index file %s\n", filename.c_str());
+            m_file.close();
+            m_entries = nullptr;
+            m_count = 0;
+            m_strings = nullptr;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::vector<size_t> cart_index::find(std::string const &text) const
+{
+    auto lower = [](std::string s)
+    {
+        for (auto &ch : s)
+            ch = (char)tolower((uint8_t)ch);
+        return s;
+    };
+
+    std::string const needle = lower(text);
+    std::vector<size_t> ret;
+
+    for (size_t i = 0; i < m_count; ++i)
+    {
+        entry const &e = m_entries[i];
+        for (uint32_t s : { e.title, e.author, e.path })
+        {
+            if (lower(str(s)).find(needle) != std::string::npos)
+            {
+                ret.push_back(i);
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+bool cart_index::update(std::string const &filename,
+                        std::vector<std::string> const &paths, int jobs)
+{
+    // Group the previous entries by file
+    std::unordered_map<std::string, std::vector<index_record>> previous;
+    {
+        cart_index old;
+        std::error_code ec;
+        if (fs::exists(filename, ec) && old.open(filename))
+        {
+            for (size_t i = 0; i < old.size(); ++i)
+            {
+                index_record r { old[i], old.str(old[i].path),
+                                 old.str(old[i].title), old.str(old[i].author) };
+                previous[r.path].push_back(std::move(r));
+            }
+        }
+    }
+
+    // Find all candidate files
+    std::vector<std::string> files;
+    for (auto const &p : paths)
+    {
+        std::error_code ec;
+        if (!fs::is_directory(p, ec))
+        {
+            files.push_back(p);
+            continue;
+        }
+
+        for (auto const &e : fs::recursive_directory_iterator(p, ec))
+        {
+            auto ext = e.path().extension();
+            if (e.is_regular_file(ec) && (ext == ".p8" || ext == ".png" || ext == ".rom"))
+                files.push_back(e.path().string());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+
+    // Index files in parallel, skipping the ones that did not change
+    std::vector<std::vector<index_record>> results(files.size());
+    std::vector<uint8_t> reused(files.size());
+
+    thread_pool pool(jobs);
+    parallel_for(pool, files.size(), [&](size_t i)
+    {
+        std::error_code ec;
+        uint64_t mtime = (uint64_t)fs::last_write_time(files[i], ec).time_since_epoch().count();
+        uint64_t size = (uint64_t)fs::file_size(files[i], ec);
+        if (ec)
+            return;
+
+        auto it = previous.find(files[i]);
+        auto const *old = it == previous.end() ? nullptr : &it->second;
+        if (old && old->size() && (*old)[0].e.mtime == mtime
+                && (*old)[0].e.file_size == size)
+        {
+            results[i] = *old;
+            reused[i] = 1;
+            return;
+        }
+
+        index_file(files[i], mtime, size, old, results[i]);
+    });
+
+    // Build the string table, sharing identical strings
+    std::string strings(1, '\0');
+    std::unordered_map<std::string, uint32_t> offsets { { "", 0 } };
+    auto add_string = [&](std::string const &s)
+    {
+        auto it = offsets.find(s);
+        if (it != offsets.end())
+            return it->second;
+        uint32_t offset = (uint32_t)strings.size();
+        strings.append(s.c_str(), s.size() + 1);
+        offsets.emplace(s, offset);
+        return offset;
+    };
+
+    std::vector<entry> entries;
+    for (auto &list : results)
+    {
+        for (auto &r : list)
+        {
+            r.e.path = add_string(r.path);
+            r.e.title = add_string(r.title);
+            r.e.author = add_string(r.author);
+            entries.push_back(r.e);
+        }
+    }
+
+    index_header h;
+    memcpy(h.magic, index_magic, sizeof(index_magic));
+    h.version = index_version;
+    h.count = (uint32_t)entries.size();
+    h.strings_offset = sizeof(h) + entries.size() * sizeof(entry);
+    h.strings_size = strings.size();
+
+    // Write to a temporary file first, so that the old index stays valid
+    // until the new one is complete.
+    std::string tmp = filename + ".tmp";
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if (!fd)
+        return false;
+    bool ok = fwrite(&h, sizeof(h), 1, fd) == 1
+           && fwrite(entries.data(), sizeof(entry), entries.size(), fd) == entries.size()
+           && fwrite(strings.data(), 1, strings.size(), fd) == strings.size();
+    ok = fclose(fd) == 0 && ok;
+
+    std::error_code ec;
+    if (ok)
+        fs::rename(tmp, filename, ec);
+    if (!ok || ec)
+    {
+        fs::remove(tmp, ec);
+        return false;
+    }
+
+    int changed = (int)std::count(reused.begin(), reused.end(), 0);
+    msg::info("indexed %d files (%d changed), %d entries\n",
+              (int)files.size(), changed, (int)entries.size());
+    return true;
+}
+
+} // namespace z8
+
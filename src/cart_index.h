@@ -0,0 +1,78 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "file.h"
+
+// The cart_index class
+// ————————————————————
+// A searchable index of a cartridge library. The index file is a header,
+// an array of fixed-size entries, and a table of NUL-terminated strings,
+// so it can be memory-mapped and used without any parsing. Each .p8,
+// .p8.png or .rom cart gets one entry; splore sheets get one entry per
+// cart on the sheet. Like the rest of the code, the file format assumes
+// a little-endian host.
+
+namespace z8
+{
+
+class cart_index
+{
+public:
+    static int const thumb_size = 32;
+    static uint16_t const no_slot = 0xffff;
+
+    struct entry
+    {
+        // Used to detect changes when updating the index
+        uint64_t mtime, file_size, hash;
+        // Offsets in the string table
+        uint32_t path, title, author;
+        uint32_t code_size, compressed_size;
+        // Position in a splore sheet, or no_slot for regular carts
+        uint16_t slot;
+        uint16_t format;
+        // Label thumbnail, two 4-bit palette indices per byte
+        uint8_t thumb[thumb_size * thumb_size / 2];
+    };
+
+    bool open(std::string const &filename);
+
+    size_t size() const { return m_count; }
+    entry const &operator[](size_t n) const { return m_entries[n]; }
+    char const *str(uint32_t offset) const { return m_strings + offset; }
+
+    // Case-insensitive search in paths, titles and authors
+    std::vector<size_t> find(std::string const &text) const;
+
+    // Index all carts found in paths (files or directories, searched
+    // recursively) and write the result to filename. Entries from the
+    // existing index are reused for files whose size and mtime, or at
+    // least whose content hash, did not change.
+    static bool update(std::string const &filename,
+                       std::vector<std::string> const &paths, int jobs = 0);
+
+private:
+    mapped_file m_file;
+    entry const *m_entries = nullptr;
+    size_t m_count = 0;
+    char const *m_strings = nullptr;
+};
+
+} // namespace z8
+
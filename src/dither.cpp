@@ -29,7 +29,7 @@
 namespace z8
 {
 
-void dither(char const *src, char const *out, bool hicolor, bool error_diffusion)
+std::vector<uint8_t> dither(lol::image im, bool hicolor, bool error_diffusion)
 {
 
     std::vector<lol::vec3> colors;
@@ -67,10 +67,6 @@ void dither(char const *src, char const *out, bool hicolor, bool error_diffusion
     }
 #endif
 
-    /* Load images */
-    lol::image im;
-    im.load(src);
-
     lol::ivec2 size(im.size());
 
 #if 0
@@ -86,8 +82,6 @@ void dither(char const *src, char const *out, bool hicolor, bool error_diffusion
 //    im = im.Resize(size * 2, ResampleAlgorithm::Bicubic)
 //           .Resize(size, ResampleAlgorithm::Bresenham);
 
-    lol::msg::info("image size %d×%d\n", size.x, size.y);
-
     lol::image dst(size);
     std::vector<uint8_t> pixels;
 
@@ -203,6 +197,19 @@ void dither(char const *src, char const *out, bool hicolor, bool error_diffusion
             }
         }
 
+    return rawdata;
+}
+
+void dither(char const *src, char const *out, bool hicolor, bool error_diffusion)
+{
+    /* Load images */
+    lol::image im;
+    im.load(src);
+
+    lol::msg::info("image size %d×%d\n", im.size().x, im.size().y);
+
+    auto rawdata = dither(im, hicolor, error_diffusion);
+
     /* Save data */
     FILE *s = out ? fopen(out, "wb+") : stdout;
     fwrite(rawdata.data(), 1, rawdata.size(), s);
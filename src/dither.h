@@ -14,10 +14,17 @@
 
 #include <lol/engine.h>
 
+#include <vector>
+#include <cstdint>
+
 namespace z8
 {
 
 void dither(char const *src, char const *out, bool hicolor, bool error_diffusion);
 
+// Same as above, but on an image already in memory; returns the raw
+// PICO-8 screen data instead of writing it to a file.
+std::vector<uint8_t> dither(lol::image im, bool hicolor, bool error_diffusion);
+
 } // namespace z8
 
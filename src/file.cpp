@@ -0,0 +1,167 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#if HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+#include <cstring>
+#include <cctype>
+
+#include "file.h"
+
+namespace z8
+{
+
+mapped_file::~mapped_file()
+{
+    close();
+}
+
+bool mapped_file::open(std::string const &filename)
+{
+    close();
+
+    for (auto const &candidate : lol::sys::get_path_list(filename))
+    {
+        if (map(candidate))
+        {
+            m_path = candidate;
+            lol::msg::debug("loaded file %s (%d bytes)\n",
+                            candidate.c_str(), (int)m_size);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void mapped_file::close()
+{
+#if HAVE_SYS_MMAN_H
+    if (m_map)
+        munmap(m_map, m_map_size);
+#endif
+    m_map = nullptr;
+    m_map_size = 0;
+    m_buffer = std::string();
+    m_data = nullptr;
+    m_size = 0;
+    m_path.clear();
+}
+
+bool mapped_file::map(std::string const &path)
+{
+#if HAVE_SYS_MMAN_H
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // The bytes after the end of the file are zero up to the end of the
+    // last page, which gives us the '\0' sentinel for free. If the file
+    // size is a multiple of the page size (e.g. a raw ROM) there is no
+    // such byte, so reserve one more zero page and map the file over the
+    // start of that reservation.
+    size_t const size = (size_t)st.st_size;
+    long const page = sysconf(_SC_PAGESIZE);
+    if (size > 0 && page > 0)
+    {
+        size_t const map_size = size % (size_t)page ? size : size + (size_t)page;
+        void *p = map_size == size
+                ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                : mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (p != MAP_FAILED && map_size != size
+             && mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        {
+            munmap(p, map_size);
+            p = MAP_FAILED;
+        }
+
+        if (p != MAP_FAILED)
+        {
+            ::close(fd);
+            m_map = p;
+            m_map_size = map_size;
+            m_data = (uint8_t const *)p;
+            m_size = size;
+            return true;
+        }
+    }
+
+    ::close(fd);
+#endif
+
+    lol::File f;
+    f.Open(path, lol::FileAccess::Read);
+    if (!f.IsValid())
+        return false;
+
+    // std::string guarantees the trailing '\0'
+    m_buffer = f.ReadString();
+    f.Close();
+    m_data = (uint8_t const *)m_buffer.c_str();
+    m_size = m_buffer.size();
+    return true;
+}
+
+file_format mapped_file::format() const
+{
+    if (!m_data)
+        return file_format::unknown;
+
+    auto starts_with = [&](size_t offset, char const *magic)
+    {
+        size_t len = strlen(magic);
+        return m_size >= offset + len && memcmp(m_data + offset, magic, len) == 0;
+    };
+
+    if (starts_with(0, "\x89PNG\r\n\x1a\n"))
+        return file_format::png;
+
+    size_t const bom = starts_with(0, "\xef\xbb\xbf") ? 3 : 0;
+    if (starts_with(bom, "pico-8 cartridge"))
+        return file_format::p8;
+
+    // Raw ROM: gfx, map, sfx etc. followed by the code section. Test this
+    // before JSON, since ROM data may start with any byte, including '{'.
+    if (m_size == 0x8000)
+        return file_format::rom;
+
+    // Raccoon carts are JSON objects
+    size_t i = bom;
+    while (i < m_size && isspace(m_data[i]))
+        ++i;
+    if (i < m_size && m_data[i] == '{')
+        return file_format::json;
+
+    return file_format::unknown;
+}
+
+} // namespace z8
+
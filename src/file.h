@@ -0,0 +1,74 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+// The mapped_file class
+// —————————————————————
+// A read-only view of a whole file. When available, the file is mapped
+// into memory instead of being copied. The data is always followed by a
+// '\0' byte, so text parsers may use it as a sentinel.
+
+namespace z8
+{
+
+enum class file_format
+{
+    unknown,
+    p8,   // .p8 text cartridge
+    png,  // .p8.png cartridge
+    rom,  // raw 32 KiB cartridge ROM
+    json, // Raccoon cartridge
+};
+
+class mapped_file
+{
+public:
+    mapped_file() = default;
+    ~mapped_file();
+
+    mapped_file(mapped_file const &) = delete;
+    mapped_file &operator =(mapped_file const &) = delete;
+
+    // Try all the candidate paths for this file
+    bool open(std::string const &filename);
+    void close();
+
+    bool is_open() const { return m_data != nullptr; }
+    uint8_t const *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    std::string_view view() const { return std::string_view((char const *)m_data, m_size); }
+    std::string const &path() const { return m_path; }
+
+    // Guess the file format from its contents
+    file_format format() const;
+
+private:
+    bool map(std::string const &path);
+
+    uint8_t const *m_data = nullptr;
+    size_t m_size = 0;
+    std::string m_path;
+
+    // Either a memory mapping, or a copy of the file
+    void *m_map = nullptr;
+    size_t m_map_size = 0;
+    std::string m_buffer;
+};
+
+} // namespace z8
+
@@ -19,10 +19,14 @@
 #include "tao/pegtl.hpp"
 
 #include "zepto8.h"
+#include "file.h"
+#include "png.h"
 #include "pico8/cart.h"
 #include "pico8/pico8.h"
 
 #include <regex>
+#include <memory>
+#include <utility>
 
 namespace z8::pico8
 {
@@ -36,84 +40,165 @@ using namespace tao;
 
 bool cart::load(std::string const &filename)
 {
-    if (load_p8(filename) || load_png(filename))
-    {
-        // Dump code to stdout
-        //msg::info("Cartridge code:\n");
-        //printf("%s", m_code.c_str());
+    // Map the file only once and pick the loader from its contents
+    auto file = std::make_shared<mapped_file>();
+    if (!file->open(filename))
+        return false;
+
+    return load(file);
+}
 
-        return true;
+bool cart::load(std::shared_ptr<mapped_file const> const &file)
+{
+    m_rom_view.reset();
+
+    bool ret = false;
+    switch (file->format())
+    {
+    case file_format::p8:
+        ret = load_p8(file->view());
+        break;
+    case file_format::png:
+        ret = load_png(*file);
+        break;
+    case file_format::rom:
+        ret = load_rom(file);
+        break;
+    default:
+        msg::error("unsupported cartridge format for %s\n", file->path().c_str());
+        break;
     }
 
-    return false;
+    // Dump code to stdout
+    //msg::info("Cartridge code:\n");
+    //printf("%s", m_code.c_str());
+
+    return ret;
 }
 
-static uint8_t const *compress_lut = nullptr;
-static char const *decompress_lut = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
+static constexpr char decompress_lut[] = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
 
-bool cart::load_png(std::string const &filename)
+// Reverse of decompress_lut, built at compile time so that several carts
+// may be compressed concurrently
+static constexpr struct compress_table
 {
-    // Open cartridge as PNG image
-    lol::image img;
-    img.load(filename);
-    ivec2 size = img.size();
+    constexpr compress_table() : value()
+    {
+        for (int i = 0; i < 0x3b; ++i)
+            value[(uint8_t)decompress_lut[i]] = i + 1;
+    }
 
-    if (size.x * size.y != (int)sizeof(m_rom) + 1)
+    constexpr uint8_t operator[](uint8_t ch) const { return value[ch]; }
+
+    uint8_t value[256];
+}
+compress_lut;
+
+bool cart::load_png(mapped_file const &file)
+{
+    // Check the image size before decoding anything, so that a bogus
+    // file cannot make us (or lol::image) inflate huge amounts of data.
+    ivec2 size;
+    if (!png_size(file.data(), file.size(), size)
+         || size.x * size.y != (int)sizeof(m_rom) + 1)
         return false;
 
-    u8vec4 const *pixels = img.lock<PixelFormat::RGBA_8>();
+    // Decode the PNG straight from memory; only use lol::image for
+    // formats our decoder does not handle.
+    std::vector<u8vec4> pixels;
+    if (!decode_png(file.data(), file.size(), size, pixels))
+    {
+        std::lock_guard<std::mutex> lock(image_lock());
+        lol::image img;
+        img.load(file.path());
+        size = img.size();
+        u8vec4 const *data = img.lock<PixelFormat::RGBA_8>();
+        pixels.assign(data, data + size.x * size.y);
+        img.unlock(data);
+    }
 
-    // Retrieve cartridge data from lower image bits
-    uint8_t version = 0;
-    for (int n = 0; n < (int)sizeof(m_rom) + 1; ++n)
+    if (size.x * size.y != (int)sizeof(m_rom) + 1)
+        return false;
+
+    // Retrieve cartridge data from the two lower bits of each component
+    for (int n = 0; n < (int)sizeof(m_rom); ++n)
     {
-        u8vec4 p = pixels[n] * 64;
-        uint8_t byte = p.a + p.r / 4 + p.g / 16 + p.b / 64;
-        (n < (int)sizeof(m_rom) ? m_rom[n] : version) = byte;
+        u8vec4 const p = pixels[n];
+        m_rom[n] = (p.a & 3) << 6 | (p.r & 3) << 4 | (p.g & 3) << 2 | (p.b & 3);
     }
 
+    u8vec4 const last = pixels[sizeof(m_rom)];
+    uint8_t const version = (last.a & 3) << 6 | (last.r & 3) << 4
+                          | (last.g & 3) << 2 | (last.b & 3);
+
     // Retrieve label from image pixels
+    m_label.clear();
     if (size.x >= LABEL_WIDTH + LABEL_X && size.y >= LABEL_HEIGHT + LABEL_Y)
     {
         m_label.resize(LABEL_WIDTH * LABEL_HEIGHT / 2);
         for (int y = 0; y < LABEL_HEIGHT; ++y)
-        for (int x = 0; x < LABEL_WIDTH; ++x)
         {
-            lol::u8vec4 p = pixels[(y + LABEL_Y) * size.x + (x + LABEL_X)];
-            uint8_t c = palette::best(p);
-            if (x & 1)
-                m_label[(y * LABEL_WIDTH + x) / 2] += c << 4;
-            else
-                m_label[(y * LABEL_WIDTH + x) / 2] = c;
+            u8vec4 const *line = pixels.data() + (y + LABEL_Y) * size.x + LABEL_X;
+            uint8_t *dst = m_label.data() + y * LABEL_WIDTH / 2;
+            for (int x = 0; x < LABEL_WIDTH; x += 2)
+                dst[x / 2] = palette::best_fast(line[x])
+                           | palette::best_fast(line[x + 1]) << 4;
         }
     }
 
-    img.unlock(pixels);
+    load_code(version);
 
-    // Retrieve code, with optional decompression
-    if (version == 0 || m_rom.code[0] != ':' || m_rom.code[1] != 'c'
-                     || m_rom.code[2] != ':' || m_rom.code[3] != '\0')
+    // Invalidate code cache
+    m_lua.resize(0);
+
+    return true;
+}
+
+bool cart::load_rom(std::shared_ptr<mapped_file const> const &file)
+{
+    // Alias the file contents instead of copying them; get_rom() will
+    // make a private copy if write access is ever needed.
+    m_rom_view = std::shared_ptr<memory const>(file, (memory const *)file->data());
+    m_label.clear();
+
+    // Raw ROMs carry no version byte, so assume the current one
+    load_code(PICO8_VERSION);
+
+    // Invalidate code cache
+    m_lua.resize(0);
+
+    return true;
+}
+
+// Retrieve code from the ROM, with optional decompression
+void cart::load_code(int version)
+{
+    // Use the const accessor so that an aliased ROM is not copied
+    memory const &rom = std::as_const(*this).get_rom();
+
+    if (version == 0 || rom.code[0] != ':' || rom.code[1] != 'c'
+                     || rom.code[2] != ':' || rom.code[3] != '\0')
     {
         int length = 0;
-        while (length < (int)sizeof(m_rom.code) && m_rom.code[length] != '\0')
+        while (length < (int)sizeof(rom.code) && rom.code[length] != '\0')
             ++length;
 
         m_code.resize(length);
-        memcpy(&m_code[0], &m_rom.code, length);
+        memcpy(&m_code[0], &rom.code, length);
     }
     else if (version == 1 || version >= 5)
     {
         // Expected data length (including trailing zero)
-        int length = m_rom.code[4] * 256
-                   + m_rom.code[5];
+        int length = rom.code[4] * 256
+                   + rom.code[5];
 
         m_code.resize(0);
-        for (int i = 8; i < (int)sizeof(m_rom.code) && (int)m_code.length() < length; ++i)
+        for (int i = 8; i < (int)sizeof(rom.code) && (int)m_code.length() < length; ++i)
         {
-            if (m_rom.code[i] >= 0x3c)
+            if (rom.code[i] >= 0x3c)
             {
-                int a = (m_rom.code[i] - 0x3c) * 16 + (m_rom.code[i + 1] & 0xf);
-                int b = m_rom.code[i + 1] / 16 + 2;
+                int a = (rom.code[i] - 0x3c) * 16 + (rom.code[i + 1] & 0xf);
+                int b = rom.code[i + 1] / 16 + 2;
                 if ((int)m_code.length() >= a)
                     while (b--)
                         m_code += m_code[m_code.length() - a];
@@ -121,8 +206,8 @@ bool cart::load_png(std::string const &filename)
             }
             else
             {
-                m_code += m_rom.code[i] ? decompress_lut[m_rom.code[i] - 1]
-                                        : m_rom.code[++i];
+                m_code += rom.code[i] ? decompress_lut[rom.code[i] - 1]
+                                      : rom.code[++i];
             }
         }
 
@@ -134,11 +219,6 @@ bool cart::load_png(std::string const &filename)
     m_code.resize(strlen(m_code.c_str()));
 
     msg::debug("version: %d code: %d\n", version, (int)m_code.length());
-
-    // Invalidate code cache
-    m_lua.resize(0);
-
-    return true;
 }
 
 //
@@ -211,17 +291,35 @@ struct p8_reader
         lab,
     };
 
-    section m_current_section;
-    std::map<int8_t, std::vector<uint8_t>> m_sections;
+    section m_current_section = section::header;
     std::string m_code;
 
+    // Data sections are decoded directly into their destination; these
+    // are the number of bytes seen so far in each section, which may be
+    // more than what fits in memory.
+    p8_reader(memory &rom, std::vector<uint8_t> &label)
+      : m_rom(rom), m_label(label)
+    {}
+
+    memory &m_rom;
+    std::vector<uint8_t> &m_label;
+    size_t m_size[8] = {};
+
+    // Partial SFX and song records, applied once complete
+    uint8_t m_sfx[4 + 32 * 5 / 2];
+    uint8_t m_mus[5];
+
+    size_t size(section s) const { return m_size[(int)s]; }
+
     //
     // Actual reader
     //
 
-    void parse(std::string const &str)
+    void parse(std::string_view str)
     {
-        pegtl::string_input<> in(str, "p8");
+        // No need to copy the data; the caller guarantees a trailing '\0'
+        // that acts as a sentinel for the hexadecimal decoder.
+        pegtl::memory_input<> in(str.data(), str.size(), "p8");
         pegtl::parse<r_file, action>(in, *this);
     }
 
@@ -265,36 +363,163 @@ struct p8_reader::action<p8_reader::r_section_name>
     }
 };
 
+// Hexadecimal digit values, or -1 for other characters
+static constexpr struct hex_table
+{
+    constexpr hex_table() : value()
+    {
+        for (int i = 0; i < 256; ++i)
+            value[i] = i >= '0' && i <= '9' ? i - '0'
+                     : i >= 'a' && i <= 'f' ? i - 'a' + 10
+                     : i >= 'A' && i <= 'F' ? i - 'A' + 10 : -1;
+    }
+
+    int8_t value[256];
+}
+hex;
+
+// Decode pairs of hexadecimal digits and call put() for each byte. gfx
+// and label data store the low nibble first. This mimics what strtoul()
+// used to do with a lone digit at the end of a line: the digit is used
+// as is, unless the data is swapped and the next char is not a space.
+template<bool swap, typename T>
+static inline void decode_hex(uint8_t const *p, uint8_t const *end, T put)
+{
+    for (; p < end; ++p)
+    {
+        int hi = hex.value[p[0]];
+        if (hi < 0)
+            continue;
+
+        int lo = hex.value[p[1]];
+        if (lo >= 0)
+            put(uint8_t(swap ? lo << 4 | hi : hi << 4 | lo));
+        else
+            put(uint8_t(!swap || isspace(p[1]) ? hi : 0));
+        ++p;
+    }
+}
+
+// Convert one SFX from the .p8 layout (4 header bytes, then 32 notes of
+// 20 bits each) to the memory layout
+static void decode_sfx(uint8_t const *src, struct sfx &dst)
+{
+    for (int j = 0; j < 32; ++j)
+    {
+        uint32_t ins = (src[4 + j * 5 / 2 + 0] << 16)
+                     | (src[4 + j * 5 / 2 + 1] << 8)
+                     | (src[4 + j * 5 / 2 + 2]);
+        // We read unaligned data; must realign it if j is odd
+        ins = (j & 1) ? ins & 0xfffff : ins >> 4;
+
+        uint16_t n = ((ins & 0x3f000) >> 4)  // pitch
+                   | ((ins & 0x00400) >> 10) // instrument (part 1)
+                   | ((ins & 0x00300) << 6)  // instrument (part 2)
+                   | ((ins & 0x00070) >> 3)  // volume
+                   | ((ins & 0x0000f) << 4); // effect
+
+        dst.notes[j][0] = n >> 8;
+        dst.notes[j][1] = n & 0x00ff;
+    }
+
+    dst.editor_mode = src[0];
+    dst.speed       = src[1];
+    dst.loop_start  = src[2];
+    dst.loop_end    = src[3];
+}
+
 template<>
 struct p8_reader::action<p8_reader::r_data>
 {
     template<typename Input>
     static void apply(Input const &in, p8_reader &r)
     {
+        uint8_t const *begin = (uint8_t const *)in.begin();
+        uint8_t const *end = (uint8_t const *)in.end();
+
         if (r.m_current_section == section::lua)
         {
             // Copy the code verbatim
-            r.m_code += in.string();
+            r.m_code.append(in.begin(), in.end());
+            return;
         }
-        else
-        {
-            bool must_swap = r.m_current_section == section::gfx
-                          || r.m_current_section == section::lab;
 
-            // Decode hexadecimal data from this section
-            auto &section = r.m_sections[(int8_t)r.m_current_section];
-            for (uint8_t const *parser = (uint8_t const *)in.begin(); parser < (uint8_t const *)in.end(); ++parser)
+        if (r.m_current_section == section::header
+             || r.m_current_section == section::error)
+            return;
+
+        size_t &pos = r.m_size[(int)r.m_current_section];
+        memory &rom = r.m_rom;
+
+        switch (r.m_current_section)
+        {
+        case section::gfx:
+            // The optional second chunk of gfx is contiguous. Use binary
+            // OR because some old versions of PICO-8 would store a full
+            // gfx+gfx2 section AND a full map+map2 section, so we cannot
+            // really decide which one is relevant.
+            decode_hex<true>(begin, end, [&](uint8_t b)
             {
-                if ((parser[0] >= 'a' && parser[0] <= 'f')
-                     || (parser[0] >= 'A' && parser[0] <= 'F')
-                     || (parser[0] >= '0' && parser[0] <= '9'))
+                if (pos < sizeof(rom.gfx))
+                    ((uint8_t *)&rom.gfx)[pos] |= b;
+                ++pos;
+            });
+            break;
+        case section::gff:
+            decode_hex<false>(begin, end, [&](uint8_t b)
+            {
+                if (pos < sizeof(rom.gfx_props))
+                    rom.gfx_props[pos] = b;
+                ++pos;
+            });
+            break;
+        case section::map:
+            // Map data + optional second chunk, see above for the OR
+            decode_hex<false>(begin, end, [&](uint8_t b)
+            {
+                if (pos < sizeof(rom.map))
+                    ((uint8_t *)&rom.map)[pos] = b;
+                else if (pos < sizeof(rom.map) + sizeof(rom.map2))
+                    rom.map2[pos - sizeof(rom.map)] |= b;
+                ++pos;
+            });
+            break;
+        case section::sfx:
+            // SFX data is packed
+            decode_hex<false>(begin, end, [&](uint8_t b)
+            {
+                size_t const n = pos / sizeof(r.m_sfx), k = pos % sizeof(r.m_sfx);
+                r.m_sfx[k] = b;
+                if (k == sizeof(r.m_sfx) - 1 && n < sizeof(rom.sfx) / sizeof(rom.sfx[0]))
+                    decode_sfx(r.m_sfx, rom.sfx[n]);
+                ++pos;
+            });
+            break;
+        case section::mus:
+            // Song data is encoded slightly differently
+            decode_hex<false>(begin, end, [&](uint8_t b)
+            {
+                size_t const n = pos / 5, k = pos % 5;
+                r.m_mus[k] = b;
+                if (k == 4 && n < sizeof(rom.song) / sizeof(rom.song[0]))
                 {
-                    char str[3] = { (char)parser[must_swap ? 1 : 0],
-                                    (char)parser[must_swap ? 0 : 1], '\0' };
-                    section.push_back((uint8_t)strtoul(str, nullptr, 16));
-                    ++parser;
+                    for (int i = 0; i < 4; ++i)
+                        rom.song[n].data[i] = r.m_mus[i + 1]
+                                            | ((r.m_mus[0] << (7 - i)) & 0x80);
                 }
-            }
+                ++pos;
+            });
+            break;
+        case section::lab:
+            decode_hex<true>(begin, end, [&](uint8_t b)
+            {
+                if (pos < r.m_label.size())
+                    r.m_label[pos] = b;
+                ++pos;
+            });
+            break;
+        default:
+            break;
         }
     }
 };
@@ -316,28 +541,14 @@ private:
     char const *m_str;
 };
 
-bool cart::load_p8(std::string const &filename)
+bool cart::load_p8(std::string_view s)
 {
-    std::string s;
-    lol::File f;
-    for (auto const &candidate : lol::sys::get_path_list(filename))
-    {
-        f.Open(candidate, lol::FileAccess::Read);
-        if (f.IsValid())
-        {
-            s = f.ReadString();
-            f.Close();
-
-            msg::debug("loaded file %s\n", candidate.c_str());
-            break;
-        }
-    }
-
-    if (s.length() == 0)
-        return false;
+    // The reader decodes data directly into memory
+    memset(&m_rom, 0, sizeof(m_rom));
+    m_label.assign(LABEL_WIDTH * LABEL_HEIGHT / 2, 0);
 
-    p8_reader reader;
-    reader.parse(s.c_str());
+    p8_reader reader(m_rom, m_label);
+    reader.parse(s);
 
     if (reader.m_version < 0)
         return false;
@@ -346,87 +557,20 @@ bool cart::load_p8(std::string const &filename)
     // but the runtime expects 8-bit characters instead.
     m_code = charset::utf8_to_pico8(reader.m_code);
 
-    memset(&m_rom, 0, sizeof(m_rom));
-
-    auto const &gfx = reader.m_sections[(int8_t)p8_reader::section::gfx];
-    auto const &gff = reader.m_sections[(int8_t)p8_reader::section::gff];
-    auto const &map = reader.m_sections[(int8_t)p8_reader::section::map];
-    auto const &sfx = reader.m_sections[(int8_t)p8_reader::section::sfx];
-    auto const &mus = reader.m_sections[(int8_t)p8_reader::section::mus];
-    auto const &lab = reader.m_sections[(int8_t)p8_reader::section::lab];
+    using section = p8_reader::section;
 
     msg::debug("version: %d code: %d gfx: %d/%d gff: %d/%d map: %d/%d "
                "sfx: %d/%d mus: %d/%d lab: %d/%d\n",
                reader.m_version, (int)m_code.length(),
-               (int)gfx.size(), (int)sizeof(m_rom.gfx),
-               (int)gff.size(), (int)sizeof(m_rom.gfx_props),
-               (int)map.size(), (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
-               (int)sfx.size() / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
-               (int)mus.size() / 5 * 4, (int)sizeof(m_rom.song),
-               (int)lab.size(), LABEL_WIDTH * LABEL_HEIGHT / 2);
-
-    // The optional second chunk of gfx is contiguous, we can copy it directly
-    memcpy(&m_rom.gfx, gfx.data(), std::min(sizeof(m_rom.gfx), gfx.size()));
-
-    memcpy(&m_rom.gfx_props, gff.data(), std::min(sizeof(m_rom.gfx_props), gff.size()));
-
-    // Map data + optional second chunk
-    memcpy(&m_rom.map, map.data(), std::min(sizeof(m_rom.map), map.size()));
-    if (map.size() > sizeof(m_rom.map))
-    {
-        size_t map2_count = std::min(sizeof(m_rom.map2),
-                                     map.size() - sizeof(m_rom.map));
-        // Use binary OR because some old versions of PICO-8 would store
-        // a full gfx+gfx2 section AND a full map+map2 section, so we cannot
-        // really decide which one is relevant.
-        for (size_t i = 0; i < map2_count; ++i)
-            m_rom.map2[i] |= map[sizeof(m_rom.map) + i];
-    }
-
-    // Song data is encoded slightly differently
-    size_t song_count = std::min(sizeof(m_rom.song) / 4,
-                                 mus.size() / 5);
-    for (size_t i = 0; i < song_count; ++i)
-    {
-        m_rom.song[i].data[0] = mus[i * 5 + 1] | ((mus[i * 5] << 7) & 0x80);
-        m_rom.song[i].data[1] = mus[i * 5 + 2] | ((mus[i * 5] << 6) & 0x80);
-        m_rom.song[i].data[2] = mus[i * 5 + 3] | ((mus[i * 5] << 5) & 0x80);
-        m_rom.song[i].data[3] = mus[i * 5 + 4] | ((mus[i * 5] << 4) & 0x80);
-    }
-
-    // SFX data is packed
-    size_t sfx_count = std::min(sizeof(m_rom.sfx) / (4 + 32 * 2),
-                                sfx.size() / (4 + 32 * 5 / 2));
-    for (size_t i = 0; i < sfx_count; ++i)
-    {
-        // FIXME move this to the parser maybe?
-        for (int j = 0; j < 32; ++j)
-        {
-            uint32_t ins = (sfx[4 + i * (4 + 80) + j * 5 / 2 + 0] << 16)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 1] << 8)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 2]);
-            // We read unaligned data; must realign it if j is odd
-            ins = (j & 1) ? ins & 0xfffff : ins >> 4;
-
-            uint16_t dst = ((ins & 0x3f000) >> 4)  // pitch
-                         | ((ins & 0x00400) >> 10) // instrument (part 1)
-                         | ((ins & 0x00300) << 6)  // instrument (part 2)
-                         | ((ins & 0x00070) >> 3)  // volume
-                         | ((ins & 0x0000f) << 4); // effect
-
-            m_rom.sfx[i].notes[j][0] = dst >> 8;
-            m_rom.sfx[i].notes[j][1] = dst & 0x00ff;
-        }
-
-        m_rom.sfx[i].editor_mode = sfx[i * (4 + 32 * 5 / 2) + 0];
-        m_rom.sfx[i].speed       = sfx[i * (4 + 32 * 5 / 2) + 1];
-        m_rom.sfx[i].loop_start  = sfx[i * (4 + 32 * 5 / 2) + 2];
-        m_rom.sfx[i].loop_end    = sfx[i * (4 + 32 * 5 / 2) + 3];
-    }
+               (int)reader.size(section::gfx), (int)sizeof(m_rom.gfx),
+               (int)reader.size(section::gff), (int)sizeof(m_rom.gfx_props),
+               (int)reader.size(section::map), (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
+               (int)reader.size(section::sfx) / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
+               (int)reader.size(section::mus) / 5 * 4, (int)sizeof(m_rom.song),
+               (int)reader.size(section::lab), LABEL_WIDTH * LABEL_HEIGHT / 2);
 
     // Optional cartridge label
-    m_label.resize(std::min(lab.size(), size_t(LABEL_WIDTH * LABEL_HEIGHT / 2)));
-    memcpy(m_label.data(), lab.data(), m_label.size());
+    m_label.resize(std::min(reader.size(section::lab), m_label.size()));
 
     // Invalidate code cache
     m_lua.resize(0);
@@ -434,10 +578,26 @@ bool cart::load_p8(std::string const &filename)
     return true;
 }
 
-lol::image cart::get_png() const
+// The PNG cartridge template only needs to be loaded once; copies are
+// cheap compared to decoding it from disk for every cart.
+static lol::image const &blank_png()
+{
+    static lol::image const blank = []()
+    {
+        lol::image img;
+        img.load("data/blank.png");
+        return img;
+    }();
+    return blank;
+}
+
+lol::image cart::get_png(bool optimal) const
 {
-    lol::image ret;
-    ret.load("data/blank.png");
+    lol::image ret = []()
+    {
+        std::lock_guard<std::mutex> lock(image_lock());
+        return blank_png();
+    }();
 
     ivec2 size = ret.size();
 
@@ -455,7 +615,7 @@ lol::image cart::get_png() const
     }
 
     /* Create ROM data */
-    std::vector<uint8_t> const &rom = get_bin();
+    std::vector<uint8_t> const &rom = get_bin(optimal);
 
     /* Write ROM to lower image bits */
     for (size_t n = 0; n < rom.size(); ++n)
@@ -469,78 +629,150 @@ lol::image cart::get_png() const
     return ret;
 }
 
-std::vector<uint8_t> cart::get_compressed_code() const
+std::vector<uint8_t> cart::get_compressed_code(bool optimal) const
 {
     std::vector<uint8_t> ret;
 
-    /* Ensure the compression LUT is initialised */
-    if (!compress_lut)
+    /* Back references can go up to 3135 bytes back and are 2 to 17 bytes
+     * long. Matches of length 1 are never useful, so candidates are found
+     * using hash chains on the first two bytes: head[] is the most recent
+     * position for a given pair of bytes, and prev[] links each position
+     * to the previous one with the same pair. Note that code[len] is the
+     * terminating '\0', which the historical brute force search could also
+     * match against. */
+    int const len = (int)m_code.length();
+    uint8_t const *code = (uint8_t const *)m_code.c_str();
+    std::vector<int> head(0x10000, -1), prev(len, -1);
+    int inserted = 0;
+
+    auto pair = [&](int n) { return code[n] << 8 | code[n + 1]; };
+
+    /* Find the longest match at position i. Among matches of the same
+     * length, the farthest one is returned, like the brute force search
+     * used to do, so that the output is unchanged. */
+    auto find_match = [&](int i, int &best_j, int &best_len)
     {
-        uint8_t *tmp = new uint8_t[256];
-        memset(tmp, 0, 256);
-        for (int i = 0; i < 0x3b; ++i)
-            tmp[(uint8_t)decompress_lut[i]] = i + 1;
-        compress_lut = tmp;
-    }
-
-    /* FIXME: PICO-8 appears to be adding an implicit \n at the
-     * end of the code, and ignoring it when compressing code. So
-     * for the moment we write one char too many. */
-    for (int i = 0; i < (int)m_code.length(); ++i)
-    {
-        /* Look behind for possible patterns */
-        int best_j = 0, best_len = 0;
-        for (int j = lol::max(i - 3135, 0); j < i; ++j)
+        for (; inserted < i; ++inserted)
         {
-            int end = std::min((int)m_code.length() - j, 17);
+            int h = pair(inserted);
+            prev[inserted] = head[h];
+            head[h] = inserted;
+        }
+
+        best_j = 0;
+        best_len = 0;
 
+        int const min_j = lol::max(i - 3135, 0);
+        for (int j = head[pair(i)]; j >= min_j; j = prev[j])
+        {
             /* XXX: official PICO-8 stops at i - j, despite being able
              * to support m_code.length() - j, it seems. */
-            end = std::min(end, i - j);
+            int end = std::min(std::min(17, i - j), std::min(len - j, len + 1 - i));
+            if (end < 2 || end < best_len)
+                continue;
 
-            for (int k = 0; ; ++k)
+            /* Check the last byte first, it rejects most candidates */
+            if (best_len > 2 && code[j + best_len - 1] != code[i + best_len - 1])
+                continue;
+
+            int k = 2;
+            while (k < end && code[j + k] == code[i + k])
+                ++k;
+
+            if (k >= best_len)
             {
-                if (k >= end || m_code[j + k] != m_code[i + k])
-                {
-                    if (k > best_len)
-                    {
-                        best_j = j;
-                        best_len = k;
-                    }
-                    break;
-                }
+                best_j = j;
+                best_len = k;
             }
         }
+    };
 
-        uint8_t byte = (uint8_t)m_code[i];
-
-        /* If best length is 2, it may or may not be interesting to emit a back
-         * reference. Most of the time, if the first character fits in a single
-         * byte, we should emit it directly. And if the first character needs
-         * to be escaped, we should always emit a back reference of length 2.
-         *
-         * However there is at least one suboptimal case with preexisting
-         * sequences “ab”, “b-”, and “-c-”. Then the sequence “ab-c-” can be
-         * encoded as “a” “b-” “c-” (5 bytes) or as “ab” “-c-” (4 bytes).
-         * Clearly it is more interesting to encode “ab” as a two-byte back
-         * reference. But since this case is statistically rare, we ignore
-         * it and accept that compression could be more efficient.
-         *
-         * If it can be a relief, PICO-8 is a lot less good than us at this. */
-        if (compress_lut[byte] && best_len <= 2)
-        {
+    auto emit_literal = [&](uint8_t byte)
+    {
+        if (compress_lut[byte])
             ret.push_back(compress_lut[byte]);
+        else
+            ret.insert(ret.end(), { '\0', byte });
+    };
+
+    auto emit_match = [&](int i, int j, int n)
+    {
+        uint8_t a = 0x3c + (i - j) / 16;
+        uint8_t b = ((i - j) & 0xf) + (n - 2) * 16;
+        ret.insert(ret.end(), { a, b });
+    };
+
+    if (optimal)
+    {
+        /* Optimal parsing: compute the longest match at every position,
+         * then find the cheapest encoding of each suffix of the code. Any
+         * prefix of a match is also a match, so a back reference of any
+         * length between 2 and the longest one may be used. */
+        std::vector<int> match_j(len), match_len(len), cost(len + 1), step(len);
+
+        for (int i = 0; i < len; ++i)
+            find_match(i, match_j[i], match_len[i]);
+
+        cost[len] = 0;
+        for (int i = len; i-- > 0; )
+        {
+            cost[i] = (compress_lut[code[i]] ? 1 : 2) + cost[i + 1];
+            step[i] = 1;
+
+            for (int n = 2; n <= match_len[i] && i + n <= len; ++n)
+                if (2 + cost[i + n] < cost[i])
+                {
+                    cost[i] = 2 + cost[i + n];
+                    step[i] = n;
+                }
         }
-        else if (best_len >= 2)
+
+        for (int i = 0; i < len; i += step[i])
         {
-            uint8_t a = 0x3c + (i - best_j) / 16;
-            uint8_t b = ((i - best_j) & 0xf) + (best_len - 2) * 16;
-            ret.insert(ret.end(), { a, b });
-            i += best_len - 1;
+            if (step[i] == 1)
+                emit_literal(code[i]);
+            else
+                emit_match(i, match_j[i], step[i]);
         }
-        else
+    }
+    else
+    {
+        /* FIXME: PICO-8 appears to be adding an implicit \n at the
+         * end of the code, and ignoring it when compressing code. So
+         * for the moment we write one char too many. */
+        for (int i = 0; i < len; ++i)
         {
-            ret.insert(ret.end(), { '\0', byte });
+            int best_j, best_len;
+            find_match(i, best_j, best_len);
+
+            uint8_t byte = code[i];
+
+            /* If best length is 2, it may or may not be interesting to emit a back
+             * reference. Most of the time, if the first character fits in a single
+             * byte, we should emit it directly. And if the first character needs
+             * to be escaped, we should always emit a back reference of length 2.
+             *
+             * However there is at least one suboptimal case with preexisting
+             * sequences “ab”, “b-”, and “-c-”. Then the sequence “ab-c-” can be
+             * encoded as “a” “b-” “c-” (5 bytes) or as “ab” “-c-” (4 bytes).
+             * Clearly it is more interesting to encode “ab” as a two-byte back
+             * reference. This greedy parser ignores that case, but the optimal
+             * parser above handles it.
+             *
+             * If it can be a relief, PICO-8 is a lot less good than us at this. */
+            if (compress_lut[byte] && best_len <= 2)
+            {
+                emit_literal(byte);
+            }
+            else if (best_len >= 2)
+            {
+                emit_match(i, best_j, best_len);
+                i += best_len - 1;
+            }
+            else
+            {
+                emit_literal(byte);
+            }
         }
     }
 
@@ -550,7 +782,7 @@ std::vector<uint8_t> cart::get_compressed_code() const
     return ret;
 }
 
-std::vector<uint8_t> cart::get_bin() const
+std::vector<uint8_t> cart::get_bin(bool optimal) const
 {
     int const data_size = offsetof(memory, code);
 
@@ -558,7 +790,7 @@ std::vector<uint8_t> cart::get_bin() const
     std::vector<uint8_t> ret;
 
     ret.resize(data_size);
-    memcpy(ret.data(), &m_rom, data_size);
+    memcpy(ret.data(), &get_rom(), data_size);
 
     ret.insert(ret.end(),
     {
@@ -568,7 +800,7 @@ std::vector<uint8_t> cart::get_bin() const
         0, 0 /* FIXME: what is this? */
     });
 
-    auto const &code = get_compressed_code();
+    auto const &code = get_compressed_code(optimal);
     ret.insert(ret.end(), code.begin(), code.end());
 
     int const rom_size = (int)sizeof(m_rom);
@@ -581,127 +813,177 @@ std::vector<uint8_t> cart::get_bin() const
     return ret;
 }
 
+// Lowercase hexadecimal digit pairs for each byte value
+static constexpr struct hex_pairs
+{
+    constexpr hex_pairs() : digits()
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            digits[i][0] = "0123456789abcdef"[i >> 4];
+            digits[i][1] = "0123456789abcdef"[i & 0xf];
+        }
+    }
+
+    char digits[256][2];
+}
+hex_out;
+
+// Write bytes as pairs of hexadecimal digits; gfx and label data store
+// the low nibble first.
+template<bool swap>
+static inline char *encode_hex(char *dst, uint8_t const *src, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, dst += 2)
+    {
+        dst[0] = hex_out.digits[src[i]][swap];
+        dst[1] = hex_out.digits[src[i]][!swap];
+    }
+    return dst;
+}
+
+// Number of lines of “stride” bytes needed to store a section up to its
+// last non-zero byte. Trailing zeroes are skipped one word at a time.
+static int used_lines(void const *data, size_t size, size_t stride)
+{
+    auto p = (uint8_t const *)data;
+    while (size >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, p + size - sizeof(word), sizeof(word));
+        if (word)
+            break;
+        size -= sizeof(word);
+    }
+    while (size > 0 && !p[size - 1])
+        --size;
+    return int((size + stride - 1) / stride);
+}
+
 std::string cart::get_p8() const
 {
-    std::string ret = "pico-8 cartridge // http://www.pico-8.com\n";
-    ret += lol::format("version %d\n", PICO8_VERSION);
+    memory const &rom = get_rom();
 
-    ret += "__lua__\n";
-    ret += z8::pico8::charset::pico8_to_utf8(get_code());
-    if (ret.back() != '\n')
-        ret += '\n';
+    char header[64];
+    int header_len = snprintf(header, sizeof(header),
+                              "pico-8 cartridge // http://www.pico-8.com\n"
+                              "version %d\n__lua__\n", PICO8_VERSION);
 
-    // Export gfx section
-    int gfx_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.gfx); ++i)
-        if (m_rom.gfx.data[i / 64][i % 64] != 0)
-            gfx_lines = 1 + i / 64;
+    std::string code = z8::pico8::charset::pico8_to_utf8(get_code());
+    bool code_eol = code.size() && code.back() != '\n';
 
-    for (int line = 0; line < gfx_lines; ++line)
+    // Only serialise m_rom.map, because m_rom.map2 overlaps with m_rom.gfx
+    // which has already been serialised.
+    // FIXME: we could choose between map2 and gfx2 by looking at line
+    // patterns, because the stride is different. See mandel.p8 for an
+    // example.
+    int gfx_lines = used_lines(&rom.gfx, sizeof(rom.gfx), 64);
+    int gff_lines = used_lines(rom.gfx_props, sizeof(rom.gfx_props), 128);
+    int map_lines = used_lines(&rom.map[0], sizeof(rom.map), 128);
+    int sfx_lines = used_lines(rom.sfx, sizeof(rom.sfx), sizeof(rom.sfx[0]));
+    int music_lines = used_lines(rom.song, sizeof(rom.song), sizeof(rom.song[0]));
+    bool has_label = m_label.size() >= LABEL_WIDTH * LABEL_HEIGHT / 2;
+
+    // Compute the exact output size, then write everything in place
+    size_t size = header_len + code.size() + code_eol
+                + (gfx_lines ? 8 + gfx_lines * (2 * 64 + 1) : 0)
+                + (has_label ? 10 + LABEL_HEIGHT * (LABEL_WIDTH + 1) + 1 : 0)
+                + (gff_lines ? 8 + gff_lines * (2 * 128 + 1) : 0)
+                + (map_lines ? 8 + map_lines * (2 * 128 + 1) : 0)
+                + (sfx_lines ? 8 + sfx_lines * (8 + 32 * 5 + 1) : 0)
+                + (music_lines ? 10 + music_lines * 12 : 0)
+                + 1;
+
+    std::string ret(size, '\0');
+    char *dst = &ret[0];
+
+    auto put = [&](char const *str, size_t len)
     {
-        if (line == 0)
-            ret += "__gfx__\n";
+        memcpy(dst, str, len);
+        dst += len;
+    };
 
-        for (int i = 0; i < 64; ++i)
-            ret += lol::format("%02x", uint8_t(m_rom.gfx.data[line][i] * 0x101 / 0x10));
+    put(header, header_len);
+    put(code.data(), code.size());
+    if (code_eol)
+        *dst++ = '\n';
 
-        ret += '\n';
+    // Export gfx section
+    if (gfx_lines)
+        put("__gfx__\n", 8);
+    for (int line = 0; line < gfx_lines; ++line)
+    {
+        dst = encode_hex<true>(dst, rom.gfx.data[line], 64);
+        *dst++ = '\n';
     }
 
     // Export label
-    if (m_label.size() >= LABEL_WIDTH * LABEL_HEIGHT / 2)
+    if (has_label)
     {
-        ret += "__label__\n";
-        for (int i = 0; i < LABEL_WIDTH * LABEL_HEIGHT / 2; ++i)
+        put("__label__\n", 10);
+        for (int line = 0; line < LABEL_HEIGHT; ++line)
         {
-            ret += lol::format("%02x", uint8_t(m_label.data()[i] * 0x101 / 0x10));
-            if ((i + 1) % (LABEL_WIDTH / 2) == 0)
-                ret += '\n';
+            dst = encode_hex<true>(dst, m_label.data() + line * LABEL_WIDTH / 2, LABEL_WIDTH / 2);
+            *dst++ = '\n';
         }
-        ret += '\n';
+        *dst++ = '\n';
     }
 
     // Export gff section
-    int gff_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.gfx_props); ++i)
-        if (m_rom.gfx_props[i] != 0)
-            gff_lines = 1 + i / 128;
-
+    if (gff_lines)
+        put("__gff__\n", 8);
     for (int line = 0; line < gff_lines; ++line)
     {
-        if (line == 0)
-            ret += "__gff__\n";
-
-        for (int i = 0; i < 128; ++i)
-            ret += lol::format("%02x", m_rom.gfx_props[128 * line + i]);
-
-        ret += '\n';
+        dst = encode_hex<false>(dst, rom.gfx_props + 128 * line, 128);
+        *dst++ = '\n';
     }
 
-    // Only serialise m_rom.map, because m_rom.map2 overlaps with m_rom.gfx
-    // which has already been serialised.
-    // FIXME: we could choose between map2 and gfx2 by looking at line
-    // patterns, because the stride is different. See mandel.p8 for an
-    // example.
-    int map_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.map); ++i)
-        if (m_rom.map[i] != 0)
-            map_lines = 1 + i / 128;
-
+    // Export map section
+    if (map_lines)
+        put("__map__\n", 8);
     for (int line = 0; line < map_lines; ++line)
     {
-        if (line == 0)
-            ret += "__map__\n";
-
-        for (int i = 0; i < 128; ++i)
-            ret += lol::format("%02x", m_rom.map[128 * line + i]);
-
-        ret += '\n';
+        dst = encode_hex<false>(dst, &rom.map[128 * line], 128);
+        *dst++ = '\n';
     }
 
     // Export sfx section
-    int sfx_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.sfx); ++i)
-        if (((uint8_t const *)&m_rom.sfx)[i] != 0)
-            sfx_lines = 1 + i / (int)sizeof(m_rom.sfx[0]);
-
+    if (sfx_lines)
+        put("__sfx__\n", 8);
     for (int line = 0; line < sfx_lines; ++line)
     {
-        if (line == 0)
-            ret += "__sfx__\n";
-
-        uint8_t const *data = (uint8_t const *)&m_rom.sfx[line];
-        ret += lol::format("%02x%02x%02x%02x", data[64], data[65], data[66], data[67]);
+        uint8_t const *data = (uint8_t const *)&rom.sfx[line];
+        dst = encode_hex<false>(dst, data + 64, 4);
         for (int j = 0; j < 64; j += 2)
         {
             int pitch = data[j] & 0x3f;
             int instrument = ((data[j + 1] << 2) & 0x4) | (data[j] >> 6);
             int volume = (data[j + 1] >> 1) & 0x7;
             int effect = (data[j + 1] >> 4) & 0xf;
-            ret += lol::format("%02x%1x%1x%1x", pitch, instrument, volume, effect);
+            *dst++ = hex_out.digits[pitch][0];
+            *dst++ = hex_out.digits[pitch][1];
+            *dst++ = hex_out.digits[instrument][1];
+            *dst++ = hex_out.digits[volume][1];
+            *dst++ = hex_out.digits[effect][1];
         }
-
-        ret += '\n';
+        *dst++ = '\n';
     }
 
     // Export music section
-    int music_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.song); ++i)
-        if (((uint8_t const *)&m_rom.song)[i] != 0)
-            music_lines = 1 + i / (int)sizeof(m_rom.song[0]);
-
+    if (music_lines)
+        put("__music__\n", 10);
     for (int line = 0; line < music_lines; ++line)
     {
-        if (line == 0)
-            ret += "__music__\n";
-
-        auto const &song = m_rom.song[line];
-        ret += lol::format("%02x %02x%02x%02x%02x\n", song.flags(),
-                                   song.sfx(0), song.sfx(1),
-                                   song.sfx(2), song.sfx(3));
+        auto const &song = rom.song[line];
+        uint8_t const data[] = { song.flags(), song.sfx(0), song.sfx(1),
+                                 song.sfx(2), song.sfx(3) };
+        dst = encode_hex<false>(dst, data, 1);
+        *dst++ = ' ';
+        dst = encode_hex<false>(dst, data + 1, 4);
+        *dst++ = '\n';
     }
 
-    ret += '\n';
+    *dst++ = '\n';
 
     return ret;
 }
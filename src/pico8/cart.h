@@ -15,33 +15,48 @@
 #include <lol/engine.h>
 
 #include <vector>
+#include <memory>
+#include <string_view>
 
 #include "analyzer.h"
 #include "pico8/memory.h"
 
 // The cart class
 // ——————————————
-// Represents a PICO-8 cartridge. Can load and unpack .p8 and .p8.png files,
-// so that the VM can then load their content into memory.
+// Represents a PICO-8 cartridge. Can load and unpack .p8, .p8.png and raw
+// 32 KiB ROM files, so that the VM can then load their content into memory.
+// ROM files are not copied: the cartridge memory aliases the mapped file
+// until someone asks for write access.
+
+namespace z8 { class mapped_file; class bench; }
 
 namespace z8::pico8
 {
 
 class cart
 {
+    friend class z8::bench;
+
 public:
     cart()
     {}
 
     bool load(std::string const &filename);
+    bool load(std::shared_ptr<mapped_file const> const &file);
 
     memory const &get_rom() const
     {
-        return m_rom;
+        return m_rom_view ? *m_rom_view : m_rom;
     }
 
     memory &get_rom()
     {
+        // Make a private copy of aliased data before allowing changes
+        if (m_rom_view)
+        {
+            m_rom = *m_rom_view;
+            m_rom_view.reset();
+        }
         return m_rom;
     }
 
@@ -62,16 +77,21 @@ public:
         return m_lua;
     }
 
-    std::vector<uint8_t> get_compressed_code() const;
-    std::vector<uint8_t> get_bin() const;
+    // If “optimal” is true, code compression uses optimal parsing instead
+    // of the greedy parser; it is slower but produces smaller output.
+    std::vector<uint8_t> get_compressed_code(bool optimal = false) const;
+    std::vector<uint8_t> get_bin(bool optimal = false) const;
     std::string get_p8() const;
-    lol::image get_png() const;
+    lol::image get_png(bool optimal = false) const;
 
 private:
-    bool load_png(std::string const &filename);
-    bool load_p8(std::string const &filename);
+    bool load_png(mapped_file const &file);
+    bool load_p8(std::string_view s);
+    bool load_rom(std::shared_ptr<mapped_file const> const &file);
+    void load_code(int version);
 
     memory m_rom;
+    std::shared_ptr<memory const> m_rom_view;
     std::vector<uint8_t> m_label;
     std::string m_code, m_lua;
     int m_version;
@@ -0,0 +1,103 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <cstring>
+
+#include "pico8/env.h"
+
+namespace z8::pico8
+{
+
+batch_env::batch_env(std::string const &filename, int count, int jobs)
+  : m_observations(count * screen_size),
+    m_done(count),
+    m_rewards(count),
+    m_pool(jobs)
+{
+    m_envs.resize(count);
+
+    // Parse the cart and the BIOS only once
+    cart rom;
+    if (!rom.load(filename))
+        lol::msg::error("unable to load cart %s\n", filename.c_str());
+    auto shared_bios = std::make_shared<bios const>();
+
+    // Starting the Lua states is still slow, do it in parallel
+    parallel_for(m_pool, m_envs.size(), [&](size_t n)
+    {
+        m_envs[n] = std::make_unique<vm>(shared_bios);
+        vm &machine = *m_envs[n];
+        machine.set_virtual_clock(true);
+        machine.load(rom);
+        machine.run();
+        observe((int)n);
+    });
+}
+
+void batch_env::step(uint16_t const *actions)
+{
+    parallel_for(m_pool, m_envs.size(), [&](size_t n)
+    {
+        vm &machine = *m_envs[n];
+        for (int i = 0; i < 16; ++i)
+            if (actions[n] & (1 << i))
+                machine.button(i, 1);
+
+        m_done[n] = !machine.step(1.f / 60.f);
+        observe((int)n);
+    });
+
+    // User code may not be thread-safe, so call it serially
+    for (size_t n = 0; n < m_envs.size(); ++n)
+        m_rewards[n] = m_reward ? m_reward(ram((int)n)) : 0.f;
+}
+
+uint8_t *batch_env::ram(int n)
+{
+    return std::get<0>(m_envs[n]->ram());
+}
+
+void batch_env::set_draw_interval(int n)
+{
+    for (auto &e : m_envs)
+        e->set_draw_interval(n);
+}
+
+void batch_env::reset(int n)
+{
+    auto restart = [&](size_t i)
+    {
+        m_envs[i]->run();
+        m_done[i] = 0;
+        m_rewards[i] = 0.f;
+        observe((int)i);
+    };
+
+    if (n >= 0)
+        restart(n);
+    else
+        parallel_for(m_pool, m_envs.size(), restart);
+}
+
+void batch_env::observe(int n)
+{
+    m_envs[n]->render_indexed(m_observations.data() + n * screen_size);
+}
+
+} // namespace z8::pico8
+
@@ -0,0 +1,90 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "pico8/vm.h"
+#include "threadpool.h"
+
+// The batch_env class
+// ———————————————————
+// Many instances of the same cart, stepped together on a thread pool,
+// for programs that drive PICO-8 games, such as agent training. Each
+// step takes one btn() bitmask per environment and writes the screens
+// of all environments as palette indices (after the screen palette is
+// applied) into a single contiguous buffer, so there is no RGBA
+// conversion and no per-step allocation. The cart and the BIOS are
+// loaded once and shared by all environments.
+//
+// There is no snapshot facility: the Lua state cannot be copied, so
+// reset() restarts the cart in the same VM instead, which is much
+// cheaper than creating a new one.
+
+namespace z8::pico8
+{
+
+class batch_env
+{
+public:
+    static int const screen_size = 128 * 128;
+
+    // Use as many threads as there are hardware threads if jobs is 0
+    batch_env(std::string const &filename, int count, int jobs = 0);
+
+    int size() const { return (int)m_envs.size(); }
+
+    // Advance all environments by one frame. actions[n] is the btn()
+    // bitmask for environment n.
+    void step(uint16_t const *actions);
+
+    // size() × 128 × 128 palette indices, updated by step() and reset()
+    uint8_t const *observations() const { return m_observations.data(); }
+
+    // Values computed by the reward function after each step, and
+    // whether each cart stopped running
+    float const *rewards() const { return m_rewards.data(); }
+    uint8_t const *done() const { return m_done.data(); }
+
+    // The reward function gets the PICO-8 memory of an environment. It
+    // is called from the calling thread, one environment after the
+    // other, once all environments have been stepped, so it does not need
+    // to be thread-safe.
+    void set_reward(std::function<float(uint8_t const *ram)> fn) { m_reward = fn; }
+
+    // Direct access to the PICO-8 memory of an environment
+    uint8_t *ram(int n);
+
+    // Only call _draw() every n steps, see vm::set_draw_interval(); the
+    // observations show the last drawn frame in between
+    void set_draw_interval(int n);
+
+    // Restart the cart in one environment, or in all of them if n < 0
+    void reset(int n = -1);
+
+private:
+    void observe(int n);
+
+    std::vector<std::unique_ptr<vm>> m_envs;
+    std::vector<uint8_t> m_observations, m_done;
+    std::vector<float> m_rewards;
+    std::function<float(uint8_t const *)> m_reward;
+    thread_pool m_pool;
+};
+
+} // namespace z8::pico8
+
@@ -15,8 +15,9 @@
 #include <lol/engine.h>
 
 #include <map>
+#include <array>
+#include <climits>
 #include <string_view>
-#include <regex>
 
 // The PICO-8 definitions
 // ——————————————————————
@@ -31,14 +32,10 @@ struct charset
     static std::string pico8_to_utf8(std::string const &str);
 
     // Map 8-bit PICO-8 characters to UTF-32 codepoints
-    static std::u32string_view to_utf32[256];
+    static std::array<std::u32string_view, 256> const to_utf32;
 
     // Map 8-bit PICO-8 characters to UTF-8 string views
-    static std::string_view to_utf8[256];
-
-private:
-    static std::regex static_init();
-    static std::regex utf8_regex;
+    static std::array<std::string_view, 256> const to_utf8;
 };
 
 struct palette
@@ -136,6 +133,48 @@ struct palette
     {
         return best(lol::vec4(c) / 255.f);
     }
+
+    /* Same as best(), but using integer maths. Cartridge labels in .p8.png
+     * files use exact palette colours except for the two lowest bits of
+     * each component, which store ROM data, so a table indexed by the
+     * high nibbles finds them directly. Other colours fall back to a
+     * distance search. */
+    static int best_fast(lol::u8vec4 c)
+    {
+        static auto const lut = []()
+        {
+            std::array<int8_t, 4096> ret;
+            ret.fill(-1);
+            for (int i = 0; i < 16; ++i)
+            {
+                lol::u8vec4 p = get8(i);
+                ret[(p.r >> 4) << 8 | (p.g >> 4) << 4 | (p.b >> 4)] = i;
+            }
+            return ret;
+        }();
+
+        int n = lut[(c.r >> 4) << 8 | (c.g >> 4) << 4 | (c.b >> 4)];
+        if (n >= 0)
+        {
+            lol::u8vec4 p = get8(n);
+            if (((c.r ^ p.r) | (c.g ^ p.g) | (c.b ^ p.b)) < 4)
+                return n;
+        }
+
+        int ret = 0, dist = INT_MAX;
+        for (int i = 0; i < 16; ++i)
+        {
+            lol::u8vec4 p = get8(i);
+            int dr = c.r - p.r, dg = c.g - p.g, db = c.b - p.b;
+            int newdist = dr * dr + dg * dg + db * db;
+            if (newdist < dist)
+            {
+                dist = newdist;
+                ret = i;
+            }
+        }
+        return ret;
+    }
 };
 
 } // namespace z8::pico8
@@ -14,110 +14,171 @@
 #   include "config.h"
 #endif
 
-// I know codecvt_utf8 is deprecated, but let’s hope C++ comes with a
-// replacement before they actually remove the feature.
-#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING 1
-
 #include <lol/engine.h>
 
-#include <locale>
 #include <string>
-#include <codecvt>
 #include <cstring>
 
 #include "pico8/pico8.h"
 #include "pico8/vm.h"
+#include "trace.h"
 
 namespace z8::pico8
 {
 
 using lol::msg;
 
-std::string_view charset::to_utf8[256];
-std::u32string_view charset::to_utf32[256];
+namespace
+{
 
-static uint8_t multibyte_start[256];
-static std::map<std::string, uint8_t> to_pico8;
-std::regex charset::utf8_regex = charset::static_init();
+// The complete PICO-8 charmap, from 0 to 255. We cannot just store
+// codepoints because some emoji glyphs are combinations of several
+// codepoints, e.g. ⬇️ is U+2B07 (down arrow) + U+FE0F (variation
+// selector-16).
+constexpr char utf8_chars[] =
+    "\0\1\2\3\4\5\6\a\b\t\n\v\f\r\16\17▮■□⁙⁘‖◀▶「」¥•、。゛゜"
+    " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNO"
+    "PQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~○"
+    "█▒🐱⬇️░✽●♥☉웃⌂⬅️😐♪🅾️◆…➡️★⧗⬆️ˇ∧❎▤▥あいうえおか"
+    "きくけこさしすせそたちつてとなにぬねのはひふへほまみむめもやゆよ"
+    "らりるれろわをんっゃゅょアイウエオカキクケコサシスセソタチツテト"
+    "ナニヌネノハヒフヘホマミムメモヤユヨラリルレロワヲンッャュョ◜◝";
+
+// Length of a UTF-8 sequence given its first byte; stray continuation
+// bytes are treated as single characters.
+constexpr int utf8_length(uint8_t ch)
+{
+    return ch < 0xc0 ? 1 : ch < 0xe0 ? 2 : ch < 0xf0 ? 3 : 4;
+}
 
-std::regex charset::static_init()
+constexpr char32_t utf8_decode(char const *p, int len)
 {
-#if _WIN32 // Work around a Visual Studio CRT bug
-    std::wstring_convert<std::codecvt_utf8<int32_t>, int32_t> cvt;
-#else
-    std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> cvt;
-#endif
+    char32_t ret = uint8_t(p[0]) & (0xff >> (len + (len > 1)));
+    for (int i = 1; i < len; ++i)
+        ret = (ret << 6) | (uint8_t(p[i]) & 0x3f);
+    return ret;
+}
 
-    // The complete PICO-8 charmap, from 0 to 255. We cannot just store
-    // codepoints because some emoji glyphs are combinations of several
-    // codepoints, e.g. ⬇️ is U+2B07 (down arrow) + U+FE0F (variation
-    // selector-16).
-    static char const utf8_chars[] =
-        "\0\1\2\3\4\5\6\a\b\t\n\v\f\r\16\17▮■□⁙⁘‖◀▶「」¥•、。゛゜"
-        " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNO"
-        "PQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~○"
-        "█▒🐱⬇️░✽●♥☉웃⌂⬅️😐♪🅾️◆…➡️★⧗⬆️ˇ∧❎▤▥あいうえおか"
-        "きくけこさしすせそたちつてとなにぬねのはひふへほまみむめもやゆよ"
-        "らりるれろわをんっゃゅょアイウエオカキクケコサシスセソタチツテト"
-        "ナニヌネノハヒフヘホマミムメモヤユヨラリルレロワヲンッャュョ◜◝";
-    static auto utf32_chars = cvt.from_bytes(utf8_chars, &utf8_chars[sizeof(utf8_chars)]);
-
-    // Create all sorts of lookup tables for PICO-8 character conversions
-    char const *p8 = utf8_chars;
-    auto const *p32 = (char32_t const *)utf32_chars.data();
-    std::string regex("(");
-    for (int i = 0; i < 256; ++i)
+// All the lookup tables, built at compile time from the charmap above.
+// Multibyte characters are found by their first codepoint using a two-
+// level radix table: the high bits select a 256-entry page, the low
+// bits an entry in that page. Entry 0 means “not a PICO-8 character”,
+// which is safe because character 0 is plain ASCII.
+struct charmap
+{
+    static int const max_pages = 16;
+
+    uint16_t utf8_offset[257] = {};
+    uint16_t utf32_offset[257] = {};
+    char32_t utf32[512] = {};
+    uint8_t page[0x20000 >> 8] = {};
+    uint8_t lut[max_pages][256] = {};
+    int pages = 1;
+
+    constexpr charmap()
     {
-        size_t len32 = p32[1] == 0xfe0f ? 2 : 1;
-        size_t len8 = ((0xe5000000 >> ((*p8 >> 3) & 0x1e)) & 3) + len32 * len32;
-        to_utf8[i] = std::string_view(p8, len8);
-        to_utf32[i] = std::u32string_view(p32, len32);
-        to_pico8[std::string(p8, len8)] = i;
-
-        // Build a regex that lets us do faster (maybe?) UTF-8 conversions
-        if (len8 > 1)
+        int p8 = 0, p32 = 0;
+        for (int i = 0; i < 256; ++i)
         {
-            multibyte_start[(uint8_t)*p8] = 1;
-            regex += std::string(p8, len8) + '|';
+            utf8_offset[i] = uint16_t(p8);
+            utf32_offset[i] = uint16_t(p32);
+
+            int len = utf8_length(utf8_chars[p8]);
+            char32_t ch = utf8_decode(utf8_chars + p8, len);
+            utf32[p32++] = ch;
+            p8 += len;
+
+            // Swallow the variation selector, if any
+            if (utf8_decode(utf8_chars + p8, utf8_length(utf8_chars[p8])) == 0xfe0f)
+            {
+                utf32[p32++] = 0xfe0f;
+                p8 += 3;
+            }
+
+            if (len > 1)
+            {
+                if (!page[ch >> 8])
+                    page[ch >> 8] = uint8_t(pages++);
+                lut[page[ch >> 8]][ch & 0xff] = uint8_t(i);
+            }
         }
+        utf8_offset[256] = uint16_t(p8);
+        utf32_offset[256] = uint16_t(p32);
+    }
 
-        p8 += len8;
-        p32 += len32;
+    constexpr uint8_t find(char32_t ch) const
+    {
+        return ch < 0x20000 ? lut[page[ch >> 8]][ch & 0xff] : 0;
     }
-    regex += ')'; // Fall back to an empty match on purpose
+};
 
-    return std::regex(regex);
+constexpr charmap table;
+static_assert(table.pages <= charmap::max_pages, "charmap lookup table is too small");
+static_assert(table.utf8_offset[256] == sizeof(utf8_chars) - 1, "charmap is inconsistent");
+
+template<typename T, typename U>
+constexpr std::array<T, 256> make_views(U const *data, uint16_t const *offset)
+{
+    std::array<T, 256> ret {};
+    for (int i = 0; i < 256; ++i)
+        ret[i] = T(data + offset[i], offset[i + 1] - offset[i]);
+    return ret;
 }
 
+} // anonymous namespace
+
+std::array<std::string_view, 256> const charset::to_utf8
+    = make_views<std::string_view>(utf8_chars, table.utf8_offset);
+std::array<std::u32string_view, 256> const charset::to_utf32
+    = make_views<std::u32string_view>(table.utf32, table.utf32_offset);
+
 std::string charset::utf8_to_pico8(std::string const &str)
 {
-    std::string ret;
-    std::smatch sm;
+    // The output is never longer than the input
+    std::string ret(str.size(), '\0');
+    char *dst = &ret[0];
 
-    for (auto p = str.begin(); p != str.end(); )
+    for (char const *p = str.data(), *end = p + str.size(); p < end; )
     {
-        // Only pass known start characters through the expensive regex
-        if (multibyte_start[(uint8_t)*p]
-             && std::regex_search(p, str.end(), sm, utf8_regex)
-             && sm.length() > 1)
+        uint8_t ch = *p;
+        if (ch >= 0xc0)
         {
-            ret += to_pico8[sm.str()];
-            p += sm.length();
-        }
-        else
-        {
-            ret += *p++;
+            // Decode one codepoint, look it up, then check that the actual
+            // bytes (including any variation selector) match the charmap.
+            int len = utf8_length(ch);
+            uint8_t c = end - p >= len ? table.find(utf8_decode(p, len)) : 0;
+            if (c)
+            {
+                auto const &s = to_utf8[c];
+                if (size_t(end - p) >= s.size() && memcmp(p, s.data(), s.size()) == 0)
+                {
+                    *dst++ = char(c);
+                    p += s.size();
+                    continue;
+                }
+            }
         }
+        *dst++ = *p++;
     }
 
+    ret.resize(dst - ret.data());
     return ret;
 }
 
 std::string charset::pico8_to_utf8(std::string const &str)
 {
-    std::string ret;
+    size_t len = 0;
+    for (uint8_t ch : str)
+        len += to_utf8[ch].size();
+
+    std::string ret(len, '\0');
+    char *dst = &ret[0];
     for (uint8_t ch : str)
-        ret += std::string(to_utf8[ch]);
+    {
+        auto const &s = to_utf8[ch];
+        memcpy(dst, s.data(), s.size());
+        dst += s.size();
+    }
     return ret;
 }
 
@@ -126,6 +187,44 @@ void vm::private_stub(std::string str)
     msg::info("z8:stub:%s\n", str.c_str());
 }
 
+void vm::private_trace(opt<std::string> name)
+{
+#if ENABLE_TRACE
+    // A call without a name ends the last event
+    if (!name)
+    {
+        if (m_trace_stack.size())
+        {
+            auto const &e = m_trace_stack.back();
+            trace::complete(e.first, e.second);
+            m_trace_stack.pop_back();
+        }
+        return;
+    }
+
+    // Event names are not copied, so use static strings
+    static char const *names[] = { "_init", "_update", "_update60", "_draw" };
+    char const *found = "lua";
+    for (auto n : names)
+        if (*name == n)
+            found = n;
+
+    m_trace_stack.push_back(std::make_pair(found, trace::now()));
+#else
+    UNUSED(name);
+#endif
+}
+
+// Close the events of traced callbacks that will never return, because
+// the cart crashed or was restarted while they were running
+void vm::end_traces()
+{
+#if ENABLE_TRACE
+    while (m_trace_stack.size())
+        private_trace(std::nullopt);
+#endif
+}
+
 opt<bool> vm::private_cartdata(opt<std::string> str)
 {
     // No argument given: we return whether there is data
@@ -0,0 +1,228 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "pico8/profiler.h"
+#include "pico8/pico8.h"
+#include "z8lua/lua.h"
+
+namespace z8::pico8
+{
+
+// The BIOS loads the cart code with this chunk name
+static char const *cart_source = "=cart";
+
+profiler::profiler(int period)
+  : m_period(std::max(period, 1))
+{
+    resume();
+}
+
+uint64_t profiler::now()
+{
+    using clock = std::chrono::steady_clock;
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               clock::now().time_since_epoch()).count();
+}
+
+void profiler::resume()
+{
+    m_last = now();
+    m_api_time = 0;
+}
+
+void profiler::sample(lua_State *l)
+{
+    if (counts_instructions())
+    {
+        add(l, nullptr, 1);
+        return;
+    }
+
+    // API calls since the last sample were already charged, and the
+    // next sample starts after our own bookkeeping
+    uint64_t elapsed = now() - m_last;
+    add(l, nullptr, elapsed > m_api_time ? elapsed - m_api_time : 0);
+    m_last = now();
+    m_api_time = 0;
+}
+
+void profiler::api_call(lua_State *l, char const *name, uint64_t start)
+{
+    // Only the instructions of the cart are counted in that mode
+    if (counts_instructions())
+        return;
+
+    // Charge the call itself, but have the next sample ignore the time
+    // spent in the call and in our bookkeeping
+    add(l, name, now() - start);
+    m_api_time += now() - start;
+}
+
+void profiler::add(lua_State *l, char const *leaf, uint64_t weight)
+{
+    if (!weight)
+        return;
+
+    // Identify the call site without formatting anything: the frames of
+    // a folded stack only depend on the functions being run, i.e. their
+    // chunk and first line, or their address for C functions. Closures
+    // are not used because carts create new ones all the time.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&hash](uint64_t x) { hash = (hash ^ x) * 0x100000001b3ull; };
+    mix((uint64_t)(uintptr_t)leaf);
+
+    lua_Debug ar;
+    int line = 0;
+    for (int level = 0; lua_getstack(l, level, &ar); ++level)
+    {
+        if (!lua_getinfo(l, "Slf", &ar))
+            break;
+        if (*ar.what == 'C')
+            mix((uint64_t)(uintptr_t)lua_tocfunction(l, -1));
+        else
+            mix((uint64_t)(uintptr_t)ar.source ^ (uint64_t)ar.linedefined << 48);
+        lua_pop(l, 1);
+        if (!line && ar.currentline > 0 && strcmp(ar.source, cart_source) == 0)
+            line = ar.currentline;
+    }
+    mix((uint64_t)line);
+
+    auto it = m_sites.find(hash);
+    if (it == m_sites.end())
+        it = m_sites.emplace(hash, site { walk(l, leaf), line }).first;
+
+    m_total += weight;
+    *it->second.weight += weight;
+
+    // The innermost cart line gets the time, even if the cart called
+    // a BIOS function or an API function.
+    if (int n = it->second.line)
+    {
+        if ((size_t)n >= m_lines.size())
+            m_lines.resize(n + 1);
+        m_lines[n] += weight;
+    }
+}
+
+// Build the folded stack of a new call site, and return its entry
+uint64_t *profiler::walk(lua_State *l, char const *leaf)
+{
+    m_frames.clear();
+
+    lua_Debug ar;
+    for (int level = 0; lua_getstack(l, level, &ar); ++level)
+    {
+        if (!lua_getinfo(l, "Sn", &ar))
+            break;
+
+        bool is_cart = strcmp(ar.source, cart_source) == 0;
+
+        // The API function itself is the leaf, passed by the caller
+        if (leaf && level == 0 && *ar.what == 'C')
+            continue;
+
+        char const *name = ar.name ? ar.name : *ar.what == 'm' ? "main" : "?";
+        if (is_cart)
+            m_frames.push_back(lol::format("%s (cart:%d)", name, ar.linedefined));
+        else if (*ar.what == 'C')
+            m_frames.push_back(lol::format("%s [C]", name));
+        else
+            m_frames.push_back(lol::format("%s [bios]", name));
+    }
+
+    // Folded stacks start with the outermost frame
+    std::string stack;
+    for (auto it = m_frames.rbegin(); it != m_frames.rend(); ++it)
+    {
+        if (stack.size())
+            stack += ';';
+        stack += *it;
+    }
+    if (leaf)
+    {
+        if (stack.size())
+            stack += ';';
+        stack += lol::format("%s [api]", leaf);
+    }
+
+    return &m_stacks[stack];
+}
+
+bool profiler::save_folded(std::string const &filename) const
+{
+    FILE *fd = fopen(filename.c_str(), "w");
+    if (!fd)
+        return false;
+
+    // Sort by stack, so that two profiles of the same cart can be diffed;
+    // times are written in microseconds
+    std::vector<std::pair<std::string, uint64_t>> stacks(m_stacks.begin(), m_stacks.end());
+    std::sort(stacks.begin(), stacks.end());
+    for (auto const &s : stacks)
+    {
+        uint64_t value = counts_instructions() ? s.second : s.second / 1000;
+        if (value)
+            fprintf(fd, "%s %llu\n", s.first.c_str(), (unsigned long long)value);
+    }
+
+    fclose(fd);
+    return true;
+}
+
+bool profiler::save_lines(std::string const &filename, std::string const &code) const
+{
+    FILE *fd = fopen(filename.c_str(), "w");
+    if (!fd)
+        return false;
+
+    uint64_t max = 0;
+    for (auto x : m_lines)
+        max = std::max(max, x);
+
+    // One line of output per line of code: the share of the total, a bar
+    // relative to the busiest line, then the code itself, converted from
+    // the PICO-8 charset so that the file is valid UTF-8
+    int line = 1;
+    for (size_t pos = 0; pos <= code.size(); ++line)
+    {
+        size_t end = std::min(code.find('\n', pos), code.size());
+        uint64_t x = (size_t)line < m_lines.size() ? m_lines[line] : 0;
+
+        if (x)
+            fprintf(fd, "%6.2f%% %-10s %5d  ", m_total ? 100.0 * x / m_total : 0.0,
+                    std::string((size_t)(10 * x + max - 1) / max, '#').c_str(), line);
+        else
+            fprintf(fd, "%7s %-10s %5d  ", "", "", line);
+        auto text = charset::pico8_to_utf8(code.substr(pos, end - pos));
+        fwrite(text.data(), 1, text.size(), fd);
+        fprintf(fd, "\n");
+
+        pos = end + 1;
+    }
+
+    fclose(fd);
+    return true;
+}
+
+} // namespace z8::pico8
+
@@ -0,0 +1,98 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+// The profiler class
+// ——————————————————
+// A profiler for the Lua code of a cart, driven by the same instruction
+// count hook that makes the VM yield. Every “period” instructions it walks
+// the Lua call stack and charges the time elapsed since the previous
+// sample to that stack, and to the cart line being run. Time spent in API
+// calls is measured separately and charged to the calling stack, with the
+// API function as the innermost frame, so that an expensive spr() loop
+// shows up as such. The time spent by the profiler itself is not charged
+// to anything.
+//
+// With a period of 1 the profiler counts instructions instead of time.
+// This is much slower, but gives the same result on every run, which is
+// what one wants when comparing two versions of a cart.
+//
+// Results are saved in the folded stack format used by flamegraph.pl,
+// speedscope and others, and as a listing of the cart code with the share
+// of the total spent on each line.
+
+struct lua_State;
+
+namespace z8::pico8
+{
+
+class profiler
+{
+public:
+    profiler(int period);
+
+    int period() const { return m_period; }
+    bool counts_instructions() const { return m_period == 1; }
+
+    // Nanoseconds on a monotonic clock
+    static uint64_t now();
+
+    // Do not charge the time since the last sample to the next one; the
+    // VM calls this before running Lua code.
+    void resume();
+
+    // Called by the instruction hook, and after each API call made by
+    // the cart
+    void sample(lua_State *l);
+    void api_call(lua_State *l, char const *name, uint64_t start);
+
+    // Total time in nanoseconds, or instruction count
+    uint64_t total() const { return m_total; }
+
+    bool save_folded(std::string const &filename) const;
+    bool save_lines(std::string const &filename, std::string const &code) const;
+
+private:
+    void add(lua_State *l, char const *leaf, uint64_t weight);
+    uint64_t *walk(lua_State *l, char const *leaf);
+
+    int m_period;
+    uint64_t m_last = 0, m_api_time = 0, m_total = 0;
+
+    std::unordered_map<std::string, uint64_t> m_stacks;
+    std::vector<uint64_t> m_lines;
+
+    // Call sites seen so far, identified by a hash of the functions on
+    // the stack, the current cart line and the API function. Only new
+    // call sites need a full stack walk and string formatting; the
+    // others point directly to their m_stacks entry, which is stable
+    // because unordered_map never moves its elements. A function called
+    // under several names keeps the first one.
+    struct site
+    {
+        uint64_t *weight;
+        int line;
+    };
+    std::unordered_map<uint64_t, site> m_sites;
+
+    // Temporary storage for the stack walk
+    std::vector<std::string> m_frames;
+};
+
+} // namespace z8::pico8
+
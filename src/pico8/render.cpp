@@ -16,8 +16,11 @@
 
 #include <lol/engine.h>
 
+#include <cstring> // memcpy
+
 #include "pico8/vm.h"
 #include "pico8/pico8.h"
+#include "trace.h"
 
 namespace z8::pico8
 {
@@ -26,6 +29,8 @@ using lol::msg;
 
 void vm::render(lol::u8vec4 *screen) const
 {
+    Z8_TRACE_SCOPE("vm::render");
+
     auto &ds = m_ram.draw_state;
 
     /* Precompute the current palette for pairs of pixels */
@@ -45,6 +50,25 @@ void vm::render(lol::u8vec4 *screen) const
     }
 }
 
+void vm::render_indexed(uint8_t *screen) const
+{
+    Z8_TRACE_SCOPE("vm::render_indexed");
+
+    auto &ds = m_ram.draw_state;
+
+    /* Same as above, with both pixels of a pair in one 16-bit value */
+    uint16_t lut[256];
+    for (int n = 0; n < 256; ++n)
+        lut[n] = ds.pal[1][n % 16] | (ds.pal[1][n / 16] << 8);
+
+    for (auto const &line : m_ram.screen.data)
+    for (uint8_t p : line)
+    {
+        ::memcpy(screen, &lut[p], 2);
+        screen += 2;
+    }
+}
+
 void vm::print_ansi(lol::ivec2 term_size,
                     uint8_t const *prev_screen) const
 {
@@ -16,13 +16,15 @@
 
 #include <lol/engine.h>
 
+#include <algorithm> // std::fill
+#include <cstring> // memcmp, memcpy
+
 #include "pico8/vm.h"
+#include "trace.h"
 
 namespace z8::pico8
 {
 
-#define DEBUG_EXPORT_WAV 0
-
 using lol::msg;
 
 enum
@@ -100,26 +102,8 @@ uint8_t song::sfx(int n) const
     return data[n] & 0x7f;
 }
 
-#if DEBUG_EXPORT_WAV
-std::map<void const *, FILE *> exports;
-#endif
-
-vm::channel::channel()
-{
-#if DEBUG_EXPORT_WAV
-    static int count = 0;
-    char const *header = "RIFF" "\xe4\xc1\x08\0" /* chunk size */ "WAVEfmt "
-        "\x10\0\0\0" /* subchunk size */ "\x01\0" /* format (PCM) */
-        "\x01\0" /* channels (1) */ "\x22\x56\0\0" /* sample rate (22050) */
-        "\x22\x56\0\0" /* byte rate */ "\x02\0" /* block align (2) */
-        "\x10\0" /* bits per sample (16) */ "data"
-        "\xc0\xc1\x08\00" /* bytes in data */;
-    exports[this] = fopen(lol::format("/tmp/zepto8_%d.wav", count++).c_str(), "w+");
-    fwrite(header, 44, 1, exports[this]);
-#endif
-}
-
-static float get_waveform(int instrument, float advance)
+static float get_waveform(int instrument, float advance,
+                          lol::perlin_noise<1> const &noise)
 {
     float t = lol::fmod(advance, 1.f);
     float ret = 0.f;
@@ -156,7 +140,6 @@ static float get_waveform(int instrument, float advance)
             //
             // This may help us create a correct filter:
             // http://www.firstpr.com.au/dsp/pink-noise/
-            static lol::perlin_noise<1> noise;
             for (float m = 1.75f, d = 1.f; m <= 128; m *= 2.25f, d *= 0.75f)
                 ret += d * noise.eval(lol::vec_t<float, 1>(m * advance));
             return ret * 0.4f;
@@ -182,46 +165,123 @@ std::function<void(void *, int)> vm::get_streamer(int ch)
     return std::bind(&vm::getaudio, this, ch, _1, _2);
 }
 
+std::function<void(void *, int)> vm::get_mixer()
+{
+    using namespace std::placeholders;
+    return std::bind(&vm::mixaudio, this, _1, _2);
+}
+
+void vm::set_sample_rate(int rate)
+{
+    m_sample_rate = lol::max(1, rate);
+
+    // Allocate the 100 ms reverb delay lines here, so that the audio
+    // thread never has to
+    for (auto &ch : m_channels)
+    {
+        ch.m_fx.delay.assign(lol::max(1, m_sample_rate / 10), 0);
+        ch.m_fx.delay_pos = 0;
+    }
+}
+
+// Render all four channels and mix them into a single mono S16 stream
+void vm::mixaudio(void *in_buffer, int in_bytes)
+{
+    Z8_TRACE_SCOPE("vm::mixaudio");
+
+    int16_t *buffer = (int16_t *)in_buffer;
+    int const samples = in_bytes / 2;
+
+    m_audio_monitor.begin(samples, m_sample_rate);
+
+    // Scratch buffers only ever grow, so that we do not allocate memory
+    // in the audio thread once the stream has started.
+    if ((int)m_mix_buffer.size() < samples)
+    {
+        m_mix_buffer.resize(samples);
+        m_mix_acc.resize(samples);
+    }
+
+    std::fill(m_mix_acc.begin(), m_mix_acc.begin() + samples, 0);
+
+    for (int chan = 0; chan < 4; ++chan)
+    {
+        getaudio(chan, m_mix_buffer.data(), samples * 2);
+        for (int i = 0; i < samples; ++i)
+            m_mix_acc[i] += m_mix_buffer[i];
+    }
+
+    for (int i = 0; i < samples; ++i)
+        buffer[i] = (int16_t)lol::clamp(m_mix_acc[i], -32768, 32767);
+
+    m_audio_monitor.end();
+}
+
 // FIXME: there is a problem with the per-channel approach; if a channel
 // advances the music, then all the other channels will reference the
 // new music chunk. Be careful when implementing music.
 void vm::getaudio(int chan, void *in_buffer, int in_bytes)
 {
-    int const samples_per_second = 22050;
+    Z8_TRACE_SCOPE("vm::getaudio");
+
     int const bytes_per_sample = 2; // mono S16 for now
 
     int16_t *buffer = (int16_t *)in_buffer;
     int const samples = in_bytes / bytes_per_sample;
 
-    for (int i = 0; i < samples; ++i)
+    auto &ch = m_channels[chan];
+    int done = 0;
+
+    // A new play object means api_sfx() started a sound: restart from
+    // the beginning of the cached samples
+    auto play = std::atomic_load(&ch.m_cache);
+    if (play != ch.m_playing)
     {
-        if (m_channels[chan].m_sfx == -1)
-        {
-            buffer[i] = 0;
-            continue;
-        }
+        ch.m_playing = play;
+        ch.m_cache_pos = 0;
+    }
 
-        int const index = m_channels[chan].m_sfx;
-        ASSERT(index >= 0 && index < 64);
-        struct sfx const &sfx = m_ram.sfx[index];
+    if (ch.m_sfx != -1)
+    {
+        ASSERT(ch.m_sfx >= 0 && ch.m_sfx < 64);
+        done = ch.m_playing ? play_cached(ch, buffer, samples)
+                            : synth(ch, m_ram.sfx[ch.m_sfx], buffer, samples);
+    }
 
-        // Speed must be 1—255 otherwise the SFX is invalid
-        int const speed = lol::max(1, (int)sfx.speed);
+    std::fill(buffer + done, buffer + samples, 0);
+
+    apply_effects(chan, buffer, samples);
+}
+
+// Synthesise samples for a channel using the given SFX data. Returns the
+// number of samples written, which is less than requested if the SFX
+// ended; the channel is stopped in that case.
+int vm::synth(channel &ch, struct sfx const &sfx, int16_t *buffer, int samples) const
+{
+    int const samples_per_second = m_sample_rate;
+
+    // Speed must be 1—255 otherwise the SFX is invalid
+    int const speed = lol::max(1, (int)sfx.speed);
 
-        float offset = m_channels[chan].m_offset;
-        float phi = m_channels[chan].m_phi;
+    // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
+    // per speed unit per note, so this is how much we should advance
+    float const offset_per_second = 22050.f / (183.f * speed);
+    float const offset_per_sample = offset_per_second / samples_per_second;
+    float const loop_range = float(sfx.loop_end - sfx.loop_start);
 
-        // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
-        // per speed unit per note, so this is how much we should advance
-        float const offset_per_second = 22050.f / (183.f * speed);
-        float const offset_per_sample = offset_per_second / samples_per_second;
+    for (int i = 0; i < samples; ++i)
+    {
+        if (ch.m_sfx == -1)
+            return i;
+
+        float offset = ch.m_offset;
+        float phi = ch.m_phi;
         float next_offset = offset + offset_per_sample;
 
         // Handle SFX loops. From the documentation: “Looping is turned
         // off when the start index >= end index”.
-        float const loop_range = float(sfx.loop_end - sfx.loop_start);
         if (loop_range > 0.f && next_offset >= sfx.loop_end
-             && m_channels[chan].m_can_loop)
+             && ch.m_can_loop)
         {
             next_offset = std::fmod(next_offset - sfx.loop_start, loop_range)
                         + sfx.loop_start;
@@ -253,9 +313,9 @@ void vm::getaudio(int chan, void *in_buffer, int in_bytes)
                     float t = lol::fmod(offset, 1.f);
                     // From the documentation: “Slide to the next note and volume”,
                     // but it’s actually _from_ the _prev_ note and volume.
-                    freq = lol::mix(key_to_freq(m_channels[chan].m_prev_key), freq, t);
-                    if (m_channels[chan].m_prev_vol > 0.f)
-                        volume = lol::mix(m_channels[chan].m_prev_vol, volume, t);
+                    freq = lol::mix(key_to_freq(ch.m_prev_key), freq, t);
+                    if (ch.m_prev_vol > 0.f)
+                        volume = lol::mix(ch.m_prev_vol, volume, t);
                     break;
                 }
                 case FX_VIBRATO:
@@ -292,38 +352,255 @@ void vm::getaudio(int chan, void *in_buffer, int in_bytes)
             }
 
             // Play note
-            float waveform = get_waveform(sfx.notes[note_id].instrument(), phi);
-
-            int16_t sample = (int16_t)(32767.99f * volume * waveform);
+            float waveform = get_waveform(sfx.notes[note_id].instrument(), phi, m_noise);
 
-            // Apply hardware effects
-            if (m_ram.hw_state.distort & (1 << chan))
-            {
-                sample = sample / 0x1000 * 0x1249;
-            }
+            buffer[i] = (int16_t)(32767.99f * volume * waveform);
 
-            buffer[i] = sample;
-
-            m_channels[chan].m_phi = phi + freq / samples_per_second;
+            ch.m_phi = phi + freq / samples_per_second;
         }
 
-        m_channels[chan].m_offset = next_offset;
+        ch.m_offset = next_offset;
 
         if (next_offset >= 32.f)
         {
-            m_channels[chan].m_sfx = -1;
+            ch.m_sfx = -1;
         }
         else if (next_note_id != note_id)
         {
-            m_channels[chan].m_prev_key = sfx.notes[note_id].key();
-            m_channels[chan].m_prev_vol = sfx.notes[note_id].volume();
+            ch.m_prev_key = sfx.notes[note_id].key();
+            ch.m_prev_vol = sfx.notes[note_id].volume();
         }
     }
 
-#if DEBUG_EXPORT_WAV
-    auto fd = exports[&m_channels[chan]];
-    fwrite(buffer, samples, 1, fd);
-#endif
+
+    return samples;
+}
+
+// Play a pre-rendered SFX. If its data was modified since it started, the
+// cached samples are no longer valid: rebuild the exact channel state by
+// synthesising the original data up to the current position, then carry
+// on with live synthesis.
+int vm::play_cached(channel &ch, int16_t *buffer, int samples)
+{
+    auto cache = ch.m_playing->sfx;
+    struct sfx const &sfx = m_ram.sfx[ch.m_sfx];
+
+    if (memcmp(&sfx, &cache->data, sizeof(sfx)) != 0)
+    {
+        // Same initial state as in api_sfx()
+        stop_cached(ch);
+        ch.m_offset = (float)cache->offset;
+        ch.m_phi = 0.f;
+        ch.m_prev_key = 24;
+        ch.m_prev_vol = 0.f;
+
+        for (int pos = 0; pos < ch.m_cache_pos; )
+        {
+            int n = synth(ch, cache->data, buffer, lol::min(samples, ch.m_cache_pos - pos));
+            if (n == 0)
+                break;
+            pos += n;
+        }
+
+        return synth(ch, sfx, buffer, samples);
+    }
+
+    int const count = lol::min(samples, (int)cache->pcm.size() - ch.m_cache_pos);
+    memcpy(buffer, cache->pcm.data() + ch.m_cache_pos, count * sizeof(*buffer));
+    ch.m_cache_pos += count;
+
+    if (ch.m_cache_pos >= (int)cache->pcm.size())
+    {
+        ch.m_sfx = -1;
+        stop_cached(ch);
+    }
+    else
+    {
+        // Keep the offset up to date for stat()
+        int const speed = lol::max(1, (int)sfx.speed);
+        ch.m_offset = cache->offset + ch.m_cache_pos * 22050.f
+                                    / (183.f * speed * cache->rate);
+    }
+
+    return count;
+}
+
+// Stop playing cached samples, unless api_sfx() already published a
+// new sound, in which case the next getaudio() call will pick it up.
+void vm::stop_cached(channel &ch)
+{
+    auto expected = ch.m_playing;
+    std::atomic_compare_exchange_strong(&ch.m_cache, &expected,
+                                        std::shared_ptr<channel::cache_play const>());
+    ch.m_playing.reset();
+}
+
+// Get the pre-rendered PCM for an SFX played from a given offset, and
+// render it if it is not in the cache yet or if the SFX data changed.
+// Since api_sfx() always resets the channel state, a non-looping SFX
+// sounds exactly the same every time it is played. Looping SFX and very
+// long SFX are not cached.
+//
+// Rendering happens on the game thread, so it is only worth it for SFX
+// that get played again with the same data. A new or modified SFX is
+// streamed by synth() the first time; carts that generate their sounds
+// by poking SFX memory before each sfx() call thus never pay for it.
+std::shared_ptr<vm::sfx_cache const> vm::get_cached_sfx(int index, int offset)
+{
+    // About 3 seconds per SFX and 6 minutes overall at 22050 Hz
+    int64_t const max_samples = 1 << 16;
+    size_t const max_total_samples = 1 << 23;
+
+    struct sfx const &sfx = m_ram.sfx[index];
+    if (sfx.loop_end > sfx.loop_start)
+        return nullptr;
+
+    int const speed = lol::max(1, (int)sfx.speed);
+    int64_t const length = (int64_t)(32 - offset) * 183 * speed
+                         * m_sample_rate / 22050;
+    if (length > max_samples)
+        return nullptr;
+
+    int const key = index * 32 + offset;
+    auto it = m_sfx_cache.find(key);
+    if (it != m_sfx_cache.end())
+    {
+        if (it->second->rate == m_sample_rate
+             && memcmp(&sfx, &it->second->data, sizeof(sfx)) == 0)
+            return it->second;
+
+        m_sfx_cache_samples -= it->second->pcm.size();
+        m_sfx_cache.erase(it);
+    }
+
+    auto seen = m_sfx_seen.find(key);
+    if (seen == m_sfx_seen.end() || memcmp(&sfx, &seen->second, sizeof(sfx)) != 0)
+    {
+        m_sfx_seen[key] = sfx;
+        return nullptr;
+    }
+    m_sfx_seen.erase(seen);
+
+    auto entry = std::make_shared<sfx_cache>();
+    entry->data = sfx;
+    entry->offset = offset;
+    entry->rate = m_sample_rate;
+
+    // Same initial state as in api_sfx()
+    channel ch;
+    ch.m_sfx = index;
+    ch.m_offset = (float)offset;
+    ch.m_phi = 0.f;
+    ch.m_prev_key = 24;
+    ch.m_prev_vol = 0.f;
+
+    size_t n = 0;
+    while (ch.m_sfx != -1)
+    {
+        entry->pcm.resize(n + 4096);
+        n += synth(ch, entry->data, entry->pcm.data() + n, 4096);
+    }
+    entry->pcm.resize(n);
+    entry->pcm.shrink_to_fit();
+
+    if (m_sfx_cache_samples + n > max_total_samples)
+    {
+        m_sfx_cache.clear();
+        m_sfx_cache_samples = 0;
+    }
+
+    m_sfx_cache_samples += n;
+    m_sfx_cache[key] = entry;
+    return entry;
+}
+
+// Apply hardware effects (0x5f40—0x5f43) to a whole buffer. The effect
+// bits are only checked once per call, and each enabled effect runs as
+// a simple loop over the buffer, using state kept in the channel.
+void vm::apply_effects(int chan, int16_t *buffer, int samples)
+{
+    auto &hw = m_ram.hw_state;
+    auto &fx = m_channels[chan].m_fx;
+
+    uint8_t const bits = ((hw.half_rate >> chan) & 1) << 0
+                       | ((hw.reverb >> chan) & 1) << 1
+                       | ((hw.distort >> chan) & 1) << 2
+                       | ((hw.lowpass >> chan) & 1) << 3;
+
+    // Reset the state of effects that were just enabled, so that we do
+    // not play stale samples from the last time they were active.
+    uint8_t const enabled = bits & ~fx.prev_bits;
+    fx.prev_bits = bits;
+
+    if (!bits)
+        return;
+
+    float const rate = (float)m_sample_rate;
+
+    // Half rate: sample and hold at 11025 Hz
+    if (bits & 0x1)
+    {
+        if (enabled & 0x1)
+            fx.hold_phase = 1.f;
+
+        float const step = lol::min(1.f, 11025.f / rate);
+        for (int i = 0; i < samples; ++i)
+        {
+            fx.hold_phase += step;
+            bool const take = fx.hold_phase >= 1.f;
+            fx.hold_phase -= take ? 1.f : 0.f;
+            fx.hold = take ? buffer[i] : fx.hold;
+            buffer[i] = fx.hold;
+        }
+    }
+
+    // Distortion: quantise the signal to 4 bits and amplify it a bit
+    if (bits & 0x4)
+    {
+        for (int i = 0; i < samples; ++i)
+            buffer[i] = buffer[i] / 0x1000 * 0x1249;
+    }
+
+    // Low pass: one-pole filter with a cutoff frequency around 2 kHz
+    if (bits & 0x8)
+    {
+        if (enabled & 0x8)
+            fx.lowpass = 0.f;
+
+        float const a = 1.f - std::exp(-6.2831853f * 2000.f / rate);
+        float y = fx.lowpass;
+        for (int i = 0; i < samples; ++i)
+        {
+            y += a * ((float)buffer[i] - y);
+            buffer[i] = (int16_t)y;
+        }
+        fx.lowpass = y;
+    }
+
+    // Reverb: feedback comb filter with a 100 ms delay line, allocated
+    // by set_sample_rate()
+    if ((bits & 0x2) && fx.delay.size())
+    {
+        int const length = (int)fx.delay.size();
+        if (enabled & 0x2)
+        {
+            std::fill(fx.delay.begin(), fx.delay.end(), int16_t(0));
+            fx.delay_pos = 0;
+        }
+
+        for (int i = 0; i < samples; )
+        {
+            // Process contiguous runs so that the inner loop has no wrap test
+            int const run = lol::min(samples - i, length - fx.delay_pos);
+            int16_t *line = fx.delay.data() + fx.delay_pos;
+            for (int j = 0; j < run; ++j, ++i)
+            {
+                int32_t y = buffer[i] + line[j] / 2;
+                line[j] = buffer[i] = (int16_t)lol::clamp(y, -32768, 32767);
+            }
+            fx.delay_pos = (fx.delay_pos + run) % length;
+        }
+    }
 }
 
 //
@@ -416,7 +693,7 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset)
                     m_channels[i].m_sfx = -1;
 
             m_channels[chan].m_sfx = sfx;
-            m_channels[chan].m_offset = std::max(0.f, (float)offset);
+            m_channels[chan].m_offset = (float)lol::max(0, (int)offset);
             m_channels[chan].m_phi = 0.f;
             m_channels[chan].m_can_loop = true;
             // Playing an instrument starting with the note C-2 and the
@@ -425,6 +702,14 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset)
             m_channels[chan].m_prev_key = 24;
             // There is no default value for “previous volume”.
             m_channels[chan].m_prev_vol = 0.f;
+
+            // Short non-looping SFX are played from pre-rendered PCM. The
+            // audio thread may be reading the channel, so hand it over
+            // atomically, along with an implicit position reset.
+            std::shared_ptr<channel::cache_play const> play;
+            if (auto cache = get_cached_sfx(sfx, lol::max(0, (int)offset)))
+                play = std::make_shared<channel::cache_play const>(channel::cache_play { cache });
+            std::atomic_store(&m_channels[chan].m_cache, play);
         }
     }
 }
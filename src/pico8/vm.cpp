@@ -16,10 +16,13 @@
 
 #include <lol/engine.h>
 
+#include <utility>
+
 #include "pico8/pico8.h"
 #include "pico8/vm.h"
 #include "bindings/lua.h"
 #include "bios.h"
+#include "trace.h"
 
 // FIXME: activate this one day, when we use Lua 5.3 maybe?
 #define HAVE_LUA_GETEXTRASPACE 0
@@ -62,21 +65,30 @@ namespace z8::pico8
 using lol::msg;
 
 vm::vm()
+  : vm(std::make_shared<bios const>())
+{
+}
+
+vm::vm(std::shared_ptr<bios const> const &bios)
 {
-    m_bios = std::make_unique<bios>();
+    m_bios = bios;
 
-    m_lua = luaL_newstate();
+    // Same as luaL_newstate(), but with an allocator that keeps stats
+    m_lua = lua_newstate(&vm::alloc_hook, this);
     lua_atpanic(m_lua, &vm::panic_hook);
     luaL_openlibs(m_lua);
 
     bindings::lua::init(m_lua, this);
 
     // Automatically yield every 1000 instructions
-    lua_sethook(m_lua, &vm::instruction_hook, LUA_MASKCOUNT, 1000);
+    lua_sethook(m_lua, &vm::instruction_hook, LUA_MASKCOUNT, m_hook_period);
 
     // Clear memory
     ::memset(&m_ram, 0, sizeof(m_ram));
 
+    // Also allocates the audio buffers for the default rate
+    set_sample_rate(m_sample_rate);
+
     // Initialize Zepto8 runtime
     int status = luaL_dostring(m_lua, m_bios->get_code().c_str());
     if (status != LUA_OK)
@@ -86,6 +98,16 @@ vm::vm()
         lua_pop(m_lua, 1);
         lol::abort();
     }
+
+#if ENABLE_TRACE
+    // Tell the BIOS to add markers around the cart callbacks, and get
+    // notified of garbage collection cycles.
+    lua_getglobal(m_lua, "_z8");
+    lua_pushboolean(m_lua, 1);
+    lua_setfield(m_lua, -2, "tracing");
+    lua_pop(m_lua, 1);
+    gc_hook(m_lua);
+#endif
 }
 
 vm::~vm()
@@ -105,7 +127,7 @@ std::tuple<uint8_t *, size_t> vm::ram()
 
 std::tuple<uint8_t *, size_t> vm::rom()
 {
-    auto rom = m_cart.get_rom();
+    auto &rom = m_cart.get_rom();
     return std::make_tuple(&rom[0], sizeof(rom));
 }
 
@@ -135,16 +157,60 @@ void vm::instruction_hook(lua_State *l, lua_Debug *)
 
     // The value 135000 was found using trial and error, but it causes
     // side effects in lots of cases. Use 300000 instead.
-    that->m_instructions += 1000;
+    that->m_instructions += that->m_hook_period;
+    that->m_stats.instructions += that->m_hook_period;
+    if (that->m_profiler)
+        that->m_profiler->sample(l);
     if (that->m_instructions >= 300000)
         lua_yield(l, 0);
 }
 
+// Lua has no callbacks for garbage collection, so this creates a table
+// with a finalizer that records an event and creates the next such table
+// when it is collected, which happens once per collection cycle.
+int vm::gc_hook(lua_State *l)
+{
+    Z8_TRACE_INSTANT("lua_gc");
+
+    lua_newtable(l);
+    lua_newtable(l);
+    lua_pushcfunction(l, &vm::gc_hook);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+    lua_pop(l, 1);
+    return 0;
+}
+
+void *vm::alloc_hook(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    vm *that = static_cast<vm *>(ud);
+
+    if (nsize == 0)
+    {
+        free(ptr);
+        return nullptr;
+    }
+
+    // When ptr is null, osize is the type of the object, not a size
+    if (!ptr || nsize > osize)
+    {
+        that->m_stats.allocs += ptr ? 0 : 1;
+        that->m_stats.alloc_bytes += ptr ? nsize - osize : nsize;
+    }
+
+    return realloc(ptr, nsize);
+}
+
 void vm::load(std::string const &name)
 {
     m_cart.load(name);
 }
 
+void vm::load(cart const &cart)
+{
+    m_cart = cart;
+}
+
 void vm::run()
 {
     // Start the cartridge!
@@ -159,7 +225,12 @@ void vm::run()
 
 bool vm::step(float seconds)
 {
-    UNUSED(seconds);
+    Z8_TRACE_SCOPE("vm::step");
+
+    if (m_profiler)
+        m_profiler->resume();
+
+    m_time += seconds;
 
     lua_getglobal(m_lua, "_z8");
     lua_getfield(m_lua, -1, "tick");
@@ -169,10 +240,66 @@ bool vm::step(float seconds)
     lua_pop(m_lua, 1);
     lua_remove(m_lua, -1);
 
+    // Callbacks may legitimately still be running if the frame yielded,
+    // so only look for an error when some of them are being traced
+    if (m_trace_stack.size() && (!ret || get_error().size()))
+        end_traces();
+
     m_instructions = 0;
     return ret;
 }
 
+void vm::enable_profiler(int period)
+{
+    m_profiler = std::make_unique<profiler>(period);
+
+    // The same hook decides when to yield, so keep counting instructions
+    // with the new period
+    m_hook_period = m_profiler->period();
+    lua_sethook(m_lua, &vm::instruction_hook, LUA_MASKCOUNT, m_hook_period);
+}
+
+void vm::set_seed(int32_t seed)
+{
+    // The RNG state is shared by the sandbox, so this also seeds the cart
+    luaL_dostring(m_lua, lol::format("srand(%d)", seed).c_str());
+}
+
+void vm::set_draw_interval(int n)
+{
+    lua_getglobal(m_lua, "_z8");
+    lua_pushnumber(m_lua, (int16_t)lol::clamp(n, 0, 0x7fff));
+    lua_setfield(m_lua, -2, "draw_interval");
+    lua_pop(m_lua, 1);
+}
+
+void vm::request_draw()
+{
+    lua_getglobal(m_lua, "_z8");
+    lua_pushboolean(m_lua, 1);
+    lua_setfield(m_lua, -2, "draw_request");
+    lua_pop(m_lua, 1);
+}
+
+bool vm::draw_pending() const
+{
+    lua_getglobal(m_lua, "_z8");
+    lua_getfield(m_lua, -1, "draw_request");
+    bool ret = lua_toboolean(m_lua, -1);
+    lua_pop(m_lua, 2);
+    return ret;
+}
+
+std::string vm::get_error() const
+{
+    lua_getglobal(m_lua, "_z8");
+    lua_getfield(m_lua, -1, "error");
+    char const *message = lua_tostring(m_lua, -1);
+    std::string ret = message ? message : "";
+    lua_pop(m_lua, 2);
+    return ret;
+}
+
 void vm::button(int index, int state)
 {
     m_buttons[1][index] += state;
@@ -199,6 +326,8 @@ void vm::api_run()
 {
     // Initialise VM state (TODO: check what else to init)
     ::memset(m_buttons, 0, sizeof(m_buttons));
+    m_time = 0.0;
+    end_traces();
 
     // Load cartridge code and call _z8.run_cart() on it
     lua_getglobal(m_sandbox_lua, "_z8");
@@ -247,7 +376,7 @@ void vm::api_reload(int16_t in_dst, int16_t in_src, opt<int16_t> in_size)
 
     // Now copy possibly legal data
     int amount = lol::min(size, (int)offsetof(memory, code) - src);
-    ::memcpy(&m_ram[dst], &m_cart.get_rom()[src], amount);
+    ::memcpy(&m_ram[dst], &std::as_const(m_cart).get_rom()[src], amount);
     dst += amount;
     size -= amount;
 
@@ -510,9 +639,13 @@ void vm::api_printh(rich_string str, opt<std::string> filename, opt<bool> overwr
     (void)filename;
     (void)overwrite;
 
-    std::string decoded;
-    for (uint8_t ch : str)
-        decoded += charset::to_utf8[ch];
+    std::string decoded = charset::pico8_to_utf8(str);
+    if (m_printh)
+    {
+        m_printh(decoded);
+        return;
+    }
+
     fprintf(stdout, "%s\n", decoded.c_str());
     fflush(stdout);
 }
@@ -579,7 +712,7 @@ var<bool, int16_t> vm::api_btnp(opt<int16_t> n, int16_t p)
 
 fix32 vm::api_time()
 {
-    return (fix32)(double)m_timer.poll();
+    return (fix32)(m_virtual_clock ? m_time : (double)m_timer.poll());
 }
 
 } // namespace z8::pico8
@@ -16,14 +16,18 @@
 
 #include <optional>
 #include <variant>
+#include <memory>
+#include <unordered_map>
 
 #include "zepto8.h"
 #include "bios.h"
 #include "pico8/cart.h"
 #include "pico8/memory.h"
+#include "pico8/profiler.h"
 #include "z8lua/lua.h"
 
-namespace z8 { class player; }
+namespace z8 { class player; class bench; }
+namespace z8::bindings { class lua; }
 
 namespace z8::pico8
 {
@@ -39,21 +43,35 @@ struct rich_string : public std::string {};
 class vm : z8::vm_base
 {
     friend class z8::player;
+    friend class z8::bench;
+    friend class z8::bindings::lua;
 
 public:
     vm();
+    // VMs created together, such as in batch_env, may share a BIOS
+    vm(std::shared_ptr<bios const> const &bios);
     virtual ~vm();
 
     virtual void load(std::string const &name);
+    // Use an already loaded cart instead of reading it again
+    void load(cart const &cart);
     virtual void run();
     virtual bool step(float seconds);
 
     virtual std::string const &get_code() const;
 
     virtual void render(lol::u8vec4 *screen) const;
+    // Same as render(), but output 128×128 palette indices
+    void render_indexed(uint8_t *screen) const;
 
     virtual std::function<void(void *, int)> get_streamer(int channel);
 
+    virtual std::function<void(void *, int)> get_mixer();
+    virtual int get_sample_rate() const { return m_sample_rate; }
+    void set_sample_rate(int rate);
+    using vm_base::get_audio_stats;
+    using vm_base::set_audio_paced;
+
     virtual void button(int index, int state);
     virtual void mouse(lol::ivec2 coords, int buttons);
     virtual void keyboard(char ch);
@@ -61,6 +79,45 @@ public:
     virtual std::tuple<uint8_t *, size_t> ram();
     virtual std::tuple<uint8_t *, size_t> rom();
 
+    // Make time() follow the emulated frames instead of the wall clock,
+    // so that runs are reproducible
+    void set_virtual_clock(bool enabled) { m_virtual_clock = enabled; }
+
+    // Send printh() output to a callback instead of stdout, e.g. when
+    // several VMs run at once and stdout is used for something else
+    void set_printh(std::function<void(std::string const &)> fn) { m_printh = fn; }
+
+    // Seed the random number generator, like srand()
+    void set_seed(int32_t seed);
+
+    // Only call _draw() every n frames, or never if n is 0, to save time
+    // when the screen is not needed. request_draw() forces a call to
+    // _draw() on the next frame that has one; 30 fps carts skip every
+    // other frame, so draw_pending() tells whether it has happened yet.
+    void set_draw_interval(int n);
+    void request_draw();
+    bool draw_pending() const;
+
+    // The last runtime error of the cart, if any
+    std::string get_error() const;
+
+    // Work done by the cart since the last reset_stats(): Lua instructions
+    // (counted by steps of 1000), API calls, and allocations made by Lua
+    struct stats
+    {
+        int64_t instructions = 0, api_calls = 0;
+        int64_t allocs = 0, alloc_bytes = 0;
+    };
+
+    stats const &get_stats() const { return m_stats; }
+    void reset_stats() { m_stats = stats(); }
+
+    // Profile the Lua code of the cart every “period” instructions, see
+    // pico8::profiler. This must be called before run(), because running
+    // coroutines keep the previous hook settings.
+    void enable_profiler(int period);
+    profiler const *get_profiler() const { return m_profiler.get(); }
+
     void print_ansi(lol::ivec2 term_size = lol::ivec2(128, 128),
                     uint8_t const *prev_screen = nullptr) const;
 
@@ -68,10 +125,14 @@ private:
     void runtime_error(std::string str);
     static int panic_hook(struct lua_State *l);
     static void instruction_hook(struct lua_State *l, struct lua_Debug *ar);
+    static void *alloc_hook(void *ud, void *ptr, size_t osize, size_t nsize);
+    static int gc_hook(struct lua_State *l);
 
     // Private methods (hidden from the user)
     opt<bool> private_cartdata(opt<std::string> str);
     void private_stub(std::string str);
+    void private_trace(opt<std::string> name);
+    void end_traces();
 
     // System
     void api_run();
@@ -196,6 +257,7 @@ public:
 
             { "__cartdata", bind<&vm::private_cartdata>() },
             { "__stub",     bind<&vm::private_stub>() },
+            { "__trace",    bind<&vm::private_trace>() },
         };
     };
 
@@ -212,7 +274,16 @@ private:
     uint8_t getspixel(int16_t x, int16_t y);
     void setspixel(int16_t x, int16_t y, uint8_t color);
 
+    struct channel;
+    struct sfx_cache;
+
     void getaudio(int channel, void *buffer, int bytes);
+    int synth(channel &ch, struct sfx const &sfx, int16_t *buffer, int samples) const;
+    int play_cached(channel &ch, int16_t *buffer, int samples);
+    void stop_cached(channel &ch);
+    std::shared_ptr<sfx_cache const> get_cached_sfx(int index, int offset);
+    void apply_effects(int channel, int16_t *buffer, int samples);
+    void mixaudio(void *buffer, int bytes);
 
 public:
     // TODO: try to get rid of this
@@ -239,10 +310,24 @@ private:
     }
     m_music;
 
-    struct channel
+    // Fully rendered PCM for a non-looping SFX played from a given offset,
+    // along with a copy of the SFX data it was rendered from.
+    struct sfx_cache
     {
-        channel();
+        struct sfx data;
+        int offset, rate;
+        std::vector<int16_t> pcm;
+    };
 
+    std::unordered_map<int, std::shared_ptr<sfx_cache const>> m_sfx_cache;
+    size_t m_sfx_cache_samples = 0;
+
+    // The SFX data seen the last time each SFX was played and not found
+    // in the cache; it only gets rendered once it is played unchanged.
+    std::unordered_map<int, struct sfx> m_sfx_seen;
+
+    struct channel
+    {
         int16_t m_sfx = -1;
         float m_offset = 0;
         float m_phi = 0;
@@ -250,11 +335,54 @@ private:
 
         int8_t m_prev_key = 0;
         float m_prev_vol = 0;
+
+        // Pre-rendered SFX being played instead of live synthesis, if any.
+        // api_sfx() publishes a new play object with std::atomic_store()
+        // every time; getaudio() notices the new pointer, and from then
+        // on the audio thread alone owns the playback position.
+        struct cache_play
+        {
+            std::shared_ptr<sfx_cache const> sfx;
+        };
+
+        std::shared_ptr<cache_play const> m_cache;
+
+        // Only accessed from the audio thread
+        std::shared_ptr<cache_play const> m_playing;
+        int m_cache_pos = 0;
+
+        // Hardware effect state
+        struct
+        {
+            uint8_t prev_bits = 0;
+            int16_t hold = 0;
+            float hold_phase = 0;
+            float lowpass = 0;
+            std::vector<int16_t> delay;
+            int delay_pos = 0;
+        }
+        m_fx;
     }
     m_channels[4];
 
+    int m_sample_rate = 22050;
+    // Each VM has its own noise generator so that VMs in different
+    // threads do not share any state
+    lol::perlin_noise<1> m_noise;
+    std::vector<int16_t> m_mix_buffer;
+    std::vector<int32_t> m_mix_acc;
+
     lol::timer m_timer;
+    bool m_virtual_clock = false;
+    double m_time = 0.0;
+    std::function<void(std::string const &)> m_printh;
     int m_instructions = 0;
+    int m_hook_period = 1000;
+    stats m_stats;
+    std::unique_ptr<profiler> m_profiler;
+
+    // Callbacks being traced, with their start times
+    std::vector<std::pair<char const *, uint64_t>> m_trace_stack;
 };
 
 } // namespace z8::pico8
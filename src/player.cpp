@@ -22,13 +22,14 @@
 #include "pico8/vm.h"
 #include "pico8/pico8.h"
 #include "raccoon/vm.h"
+#include "trace.h"
 
 namespace z8
 {
 
 using lol::msg;
 
-player::player(bool is_raccoon)
+player::player(bool is_raccoon, int audio_rate, int quality)
   : m_input_map
     {
         { lol::input::key::SC_Left, 0 },
@@ -73,12 +74,18 @@ player::player(bool is_raccoon)
     scene.PushCamera(m_scenecam);
     lol::Ticker::Ref(m_scenecam);
 
-    // Register audio callbacks
-    for (int i = 0; i < 4; ++i)
+    // Register a single audio callback for the mixed channels, so that
+    // the backend only has one stream to convert. If requested, do the
+    // conversion to the device rate ourselves.
+    auto f = m_vm->get_mixer();
+    int rate = m_vm->get_sample_rate();
+    if (audio_rate > 0 && audio_rate != rate)
     {
-        auto f = m_vm->get_streamer(i);
-        m_streams[i] = lol::audio::start_streaming(f, lol::audio::format::sint16le, 22050, 1);
+        m_resampler = std::make_unique<resampler>(f, rate, audio_rate, quality);
+        f = m_resampler->get_streamer();
+        rate = audio_rate;
     }
+    m_stream = lol::audio::start_streaming(f, lol::audio::format::sint16le, rate, 1);
 
     // FIXME: the image gets deleted by TextureImage class, it
     // does not seem right to me.
@@ -99,8 +106,7 @@ player::~player()
     lol::TileSet::destroy(m_tile);
     lol::TileSet::destroy(m_font_tile);
 
-    for (int i = 0; i < 4; ++i)
-        lol::audio::stop_streaming(i);
+    lol::audio::stop_streaming(m_stream);
 
     lol::Scene& scene = lol::Scene::GetScene();
     lol::Ticker::Unref(m_scenecam);
@@ -119,6 +125,8 @@ void player::run()
 
 void player::tick_game(float seconds)
 {
+    Z8_TRACE_SCOPE("player::tick_game");
+
     lol::WorldEntity::tick_game(seconds);
 
     // Aspect ratio
@@ -127,43 +135,80 @@ void player::tick_game(float seconds)
     m_screen_pos = ivec2((lol::vec2(m_win_size) - lol::vec2(SCREEN_WIDTH * m_scale, SCREEN_HEIGHT * m_scale)) / 2.f);
     m_scenecam->SetProjection(lol::mat4::ortho(0.f, (float)m_win_size.x, 0.f, (float)m_win_size.y, -100.f, 100.f));
 
-    auto mouse = lol::input::mouse();
-    auto keyboard = lol::input::keyboard();
-
-    // Update button states
-    for (auto const &k : m_input_map)
-        m_vm->button(k.second, keyboard->key(k.first));
-
-    if (keyboard->key_pressed(lol::input::key::SC_Return))
-        m_vm->keyboard('\r');
-    if (keyboard->key_pressed(lol::input::key::SC_Backspace))
-        m_vm->keyboard('\x08');
-    if (keyboard->key_pressed(lol::input::key::SC_Delete))
-        m_vm->keyboard('\x7f');
-
-    // Mouse events
-    lol::ivec2 mouse_pos((int)mouse->axis(lol::input::axis::ScreenX),
-                         (int)mouse->axis(lol::input::axis::ScreenY));
-    int buttons = (mouse->button(lol::input::button::BTN_Left) ? 1 : 0)
-                + (mouse->button(lol::input::button::BTN_Right) ? 2 : 0)
-                + (mouse->button(lol::input::button::BTN_Middle) ? 4 : 0);
-    m_vm->mouse(mouse_pos - m_screen_pos, buttons);
-
-    // Keyboard events
-    for (auto ch : keyboard->text())
+    if (m_replay.is_open() && !m_replay.next_frame(*m_vm))
+        lol::msg::info("end of input recording\n");
+
+    // Live input is ignored while a recording is being played back
+    if (!m_replay.is_open())
     {
-        // Convert uppercase characters to special glyphs
-        if (ch >= 'A' && ch <= 'Z')
-            ch = '\x80' + (ch - 'A');
-        m_vm->keyboard(ch);
+        auto mouse = lol::input::mouse();
+        auto keyboard = lol::input::keyboard();
+
+        auto button = [&](int index, int state)
+        {
+            m_vm->button(index, state);
+            m_record.button(index, state);
+        };
+
+        auto key = [&](char ch)
+        {
+            m_vm->keyboard(ch);
+            m_record.keyboard(ch);
+        };
+
+        // Update button states
+        for (auto const &k : m_input_map)
+            button(k.second, keyboard->key(k.first));
+
+        if (keyboard->key_pressed(lol::input::key::SC_Return))
+            key('\r');
+        if (keyboard->key_pressed(lol::input::key::SC_Backspace))
+            key('\x08');
+        if (keyboard->key_pressed(lol::input::key::SC_Delete))
+            key('\x7f');
+
+        // Mouse events
+        lol::ivec2 mouse_pos((int)mouse->axis(lol::input::axis::ScreenX),
+                             (int)mouse->axis(lol::input::axis::ScreenY));
+        int buttons = (mouse->button(lol::input::button::BTN_Left) ? 1 : 0)
+                    + (mouse->button(lol::input::button::BTN_Right) ? 2 : 0)
+                    + (mouse->button(lol::input::button::BTN_Middle) ? 4 : 0);
+        m_vm->mouse(mouse_pos - m_screen_pos, buttons);
+        m_record.mouse(mouse_pos - m_screen_pos, buttons);
+
+        // Keyboard events
+        for (auto ch : keyboard->text())
+        {
+            // Convert uppercase characters to special glyphs
+            if (ch >= 'A' && ch <= 'Z')
+                ch = '\x80' + (ch - 'A');
+            key(ch);
+        }
+
+        m_record.next_frame();
     }
 
     // Step the VM
     m_vm->step(seconds);
+
+    // Periodically report audio statistics
+    if (m_audio_stats_period > 0.f)
+    {
+        m_audio_stats_timer += seconds;
+        if (m_audio_stats_timer >= m_audio_stats_period)
+        {
+            auto stats = m_vm->get_audio_stats(true);
+            msg::info("%s\n", stats.report(m_audio_stats_prev).c_str());
+            m_audio_stats_prev = stats;
+            m_audio_stats_timer = 0.f;
+        }
+    }
 }
 
 void player::tick_draw(float seconds, lol::Scene &scene)
 {
+    Z8_TRACE_SCOPE("player::tick_draw");
+
     lol::WorldEntity::tick_draw(seconds, scene);
 
     // Render the VM screen to our buffer
@@ -171,6 +216,8 @@ void player::tick_draw(float seconds, lol::Scene &scene)
 
     if (m_vm->m_bios) // FIXME: PICO-8 specific
     {
+        Z8_TRACE_SCOPE("player::upload_font");
+
         // Render the font
         u8vec4 data[128 * 32];
         for (int j = 0; j < 32; ++j)
@@ -185,8 +232,11 @@ void player::tick_draw(float seconds, lol::Scene &scene)
 
     // Blit buffer to the texture
     // FIXME: move this to some kind of memory viewer class?
-    m_tile->GetTexture()->Bind();
-    m_tile->GetTexture()->SetData(m_screen.data());
+    {
+        Z8_TRACE_SCOPE("player::upload_screen");
+        m_tile->GetTexture()->Bind();
+        m_tile->GetTexture()->SetData(m_screen.data());
+    }
 
     // Special mode where we render ourselves
     if (m_render)
@@ -16,6 +16,8 @@
 
 #include "zepto8.h"
 #include "pico8/cart.h"
+#include "resampler.h"
+#include "replay.h"
 
 // The player class
 // ————————————————
@@ -31,7 +33,9 @@ using lol::u8vec4;
 class player : public lol::WorldEntity
 {
 public:
-    player(bool is_raccoon = false);
+    // If audio_rate is non-zero, audio is resampled to that rate before
+    // being handed to the backend; quality goes from 0 (fast) to 4.
+    player(bool is_raccoon = false, int audio_rate = 0, int quality = 2);
     virtual ~player();
 
     virtual void tick_game(float seconds) override;
@@ -42,6 +46,14 @@ public:
 
     std::shared_ptr<vm_base> get_vm() { return m_vm; }
 
+    // Print audio statistics every “period” seconds (0 to disable)
+    void show_audio_stats(float period) { m_audio_stats_period = period; }
+
+    // Save all input to a file, or take input from a file instead of
+    // the keyboard and mouse until the end of the recording
+    bool record(std::string const &name) { return m_record.open(name.c_str()); }
+    bool replay(std::string const &name) { return m_replay.open(name.c_str()); }
+
     // HACK: if get_texture() is called, rendering is disabled (this
     // is so that we do not overwrite the IDE screen)
     lol::Texture *get_texture();
@@ -51,6 +63,8 @@ private:
     std::shared_ptr<vm_base> m_vm;
 
     std::map<lol::input::key, int> m_input_map;
+    input_writer m_record;
+    input_reader m_replay;
     array<u8vec4> m_screen;
 
     // Video
@@ -60,7 +74,10 @@ private:
     float m_scale;
 
     // Audio
-    int m_streams[4];
+    std::unique_ptr<resampler> m_resampler;
+    int m_stream;
+    float m_audio_stats_period = 0.f, m_audio_stats_timer = 0.f;
+    audio_stats m_audio_stats_prev;
 
     lol::Camera *m_scenecam;
     lol::TileSet *m_tile, *m_font_tile;
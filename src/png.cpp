@@ -0,0 +1,524 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <cstring>
+#include <cstdlib>
+
+#include "png.h"
+
+namespace z8
+{
+
+//
+// Inflate (RFC 1950 and RFC 1951)
+//
+
+namespace
+{
+
+struct bit_reader
+{
+    bit_reader(uint8_t const *data, size_t size)
+      : m_data(data), m_end(data + size)
+    {}
+
+    // Ensure at least 32 bits are available; past the end of the input
+    // we feed zeroes and remember that the stream was truncated.
+    inline void refill()
+    {
+        while (m_count <= 56)
+        {
+            uint64_t byte = 0;
+            if (m_data < m_end)
+                byte = *m_data++;
+            else
+                ++m_overrun;
+            m_bits |= byte << m_count;
+            m_count += 8;
+        }
+    }
+
+    inline uint32_t peek(int n)
+    {
+        if (m_count < n)
+            refill();
+        return (uint32_t)(m_bits & ((uint64_t(1) << n) - 1));
+    }
+
+    inline void skip(int n)
+    {
+        m_bits >>= n;
+        m_count -= n;
+    }
+
+    inline uint32_t get(int n)
+    {
+        uint32_t ret = peek(n);
+        skip(n);
+        return ret;
+    }
+
+    // Discard bits up to the next byte boundary, and return the reader
+    // to byte mode for stored blocks
+    void align()
+    {
+        skip(m_count & 7);
+
+        // Give back the whole bytes that were read ahead, except the
+        // zeroes we made up past the end
+        int const buffered = m_count / 8;
+        int const fake = lol::min(m_overrun, buffered);
+        m_data -= buffered - fake;
+        m_overrun -= fake;
+        m_bits = 0;
+        m_count = 0;
+    }
+
+    // True if some of the made up zeroes were actually consumed
+    bool truncated() const { return m_overrun * 8 > m_count; }
+
+    uint8_t const *m_data, *m_end;
+    uint64_t m_bits = 0;
+    int m_count = 0, m_overrun = 0;
+};
+
+struct huffman
+{
+    static int const fast_bits = 10;
+
+    // Entries of the fast table are (symbol << 4) | length, or zero if
+    // the code is longer than fast_bits
+    uint16_t fast[1 << fast_bits];
+    uint16_t count[16];
+    uint16_t symbol[288];
+
+    bool build(uint8_t const *lengths, int n)
+    {
+        memset(count, 0, sizeof(count));
+        for (int i = 0; i < n; ++i)
+            ++count[lengths[i]];
+        count[0] = 0;
+
+        // Reject over-subscribed codes; incomplete ones are legal
+        int left = 1;
+        for (int len = 1; len < 16; ++len)
+        {
+            left = left * 2 - count[len];
+            if (left < 0)
+                return false;
+        }
+
+        uint16_t offs[16];
+        offs[1] = 0;
+        for (int len = 1; len < 15; ++len)
+            offs[len + 1] = offs[len] + count[len];
+        for (int i = 0; i < n; ++i)
+            if (lengths[i])
+                symbol[offs[lengths[i]]++] = i;
+
+        // Fill the fast table with the bit-reversed canonical codes
+        memset(fast, 0, sizeof(fast));
+        int code = 0, index = 0;
+        for (int len = 1; len <= fast_bits; ++len)
+        {
+            for (int k = 0; k < count[len]; ++k, ++code, ++index)
+            {
+                int rev = 0;
+                for (int b = 0; b < len; ++b)
+                    rev |= ((code >> b) & 1) << (len - 1 - b);
+                for (int j = rev; j < (1 << fast_bits); j += 1 << len)
+                    fast[j] = uint16_t(symbol[index] << 4 | len);
+            }
+            code <<= 1;
+        }
+
+        return true;
+    }
+
+    // Returns the decoded symbol, or -1 on error
+    inline int decode(bit_reader &br) const
+    {
+        uint16_t e = fast[br.peek(fast_bits)];
+        if (e)
+        {
+            br.skip(e & 0xf);
+            return e >> 4;
+        }
+
+        // Slow path: walk the canonical code one bit at a time
+        br.peek(15);
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len < 16; ++len)
+        {
+            code |= (int)(br.m_bits >> (len - 1)) & 1;
+            int const n = count[len];
+            if (code - n < first)
+            {
+                br.skip(len);
+                return symbol[index + (code - first)];
+            }
+            index += n;
+            first = (first + n) << 1;
+            code <<= 1;
+        }
+
+        return -1;
+    }
+};
+
+static uint16_t const length_base[] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static uint8_t const length_extra[] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static uint16_t const dist_base[] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577,
+};
+
+static uint8_t const dist_extra[] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static bool inflate_block(bit_reader &br, huffman const &lit,
+                          huffman const &dist, std::vector<uint8_t> &out,
+                          size_t max_size)
+{
+    for (;;)
+    {
+        int sym = lit.decode(br);
+        if (sym < 0 || br.truncated())
+            return false;
+
+        if (sym < 256)
+        {
+            if (out.size() >= max_size)
+                return false;
+            out.push_back((uint8_t)sym);
+            continue;
+        }
+
+        if (sym == 256)
+            return true;
+
+        sym -= 257;
+        if (sym >= 29)
+            return false;
+        size_t len = length_base[sym] + br.get(length_extra[sym]);
+
+        int dsym = dist.decode(br);
+        if (dsym < 0 || dsym >= 30)
+            return false;
+        size_t d = dist_base[dsym] + br.get(dist_extra[dsym]);
+        if (d > out.size() || len > max_size - out.size())
+            return false;
+
+        // Copies may overlap, so go byte by byte
+        size_t pos = out.size();
+        out.resize(pos + len);
+        uint8_t *p = out.data() + pos;
+        for (size_t i = 0; i < len; ++i)
+            p[i] = p[i - d];
+    }
+}
+
+} // anonymous namespace
+
+bool inflate(uint8_t const *data, size_t size, std::vector<uint8_t> &out,
+             size_t max_size)
+{
+    // zlib header: deflate method, no preset dictionary
+    if (size < 2 || (data[0] & 0x0f) != 8 || (data[1] & 0x20)
+         || (data[0] * 256 + data[1]) % 31 != 0)
+        return false;
+
+    bit_reader br(data + 2, size - 2);
+    huffman lit, dist;
+
+    for (bool last = false; !last; )
+    {
+        last = br.get(1);
+        int const type = br.get(2);
+
+        if (type == 0)
+        {
+            // Stored block
+            br.align();
+            if (br.m_end - br.m_data < 4)
+                return false;
+            size_t len = br.m_data[0] | br.m_data[1] << 8;
+            size_t nlen = br.m_data[2] | br.m_data[3] << 8;
+            if (len != (~nlen & 0xffff) || (size_t)(br.m_end - br.m_data - 4) < len
+                 || len > max_size - out.size())
+                return false;
+            out.insert(out.end(), br.m_data + 4, br.m_data + 4 + len);
+            br.m_data += 4 + len;
+        }
+        else if (type == 1)
+        {
+            // Fixed Huffman codes
+            uint8_t lengths[288 + 30];
+            memset(lengths, 8, 144);
+            memset(lengths + 144, 9, 112);
+            memset(lengths + 256, 7, 24);
+            memset(lengths + 280, 8, 8);
+            memset(lengths + 288, 5, 30);
+            lit.build(lengths, 288);
+            dist.build(lengths + 288, 30);
+            if (!inflate_block(br, lit, dist, out, max_size))
+                return false;
+        }
+        else if (type == 2)
+        {
+            // Dynamic Huffman codes
+            static uint8_t const order[19] =
+                { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+            int const nlen = br.get(5) + 257;
+            int const ndist = br.get(5) + 1;
+            int const ncode = br.get(4) + 4;
+            if (nlen > 286 || ndist > 30)
+                return false;
+
+            uint8_t lengths[288 + 32] = {};
+            for (int i = 0; i < ncode; ++i)
+                lengths[order[i]] = (uint8_t)br.get(3);
+
+            huffman code;
+            if (!code.build(lengths, 19))
+                return false;
+
+            memset(lengths, 0, 19);
+            for (int i = 0; i < nlen + ndist; )
+            {
+                int sym = code.decode(br);
+                if (sym < 0 || br.truncated())
+                    return false;
+
+                if (sym < 16)
+                {
+                    lengths[i++] = (uint8_t)sym;
+                    continue;
+                }
+
+                int repeat, value = 0;
+                if (sym == 16)
+                {
+                    if (i == 0)
+                        return false;
+                    value = lengths[i - 1];
+                    repeat = 3 + br.get(2);
+                }
+                else if (sym == 17)
+                    repeat = 3 + br.get(3);
+                else
+                    repeat = 11 + br.get(7);
+
+                if (i + repeat > nlen + ndist)
+                    return false;
+                while (repeat--)
+                    lengths[i++] = (uint8_t)value;
+            }
+
+            if (!lit.build(lengths, nlen) || !dist.build(lengths + nlen, ndist))
+                return false;
+            if (!inflate_block(br, lit, dist, out, max_size))
+                return false;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return !br.truncated();
+}
+
+//
+// PNG
+//
+
+static inline uint32_t be32(uint8_t const *p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+bool png_size(uint8_t const *data, size_t size, lol::ivec2 &image_size)
+{
+    // The IHDR chunk is always first, right after the signature
+    if (size < 8 + 8 + 13 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0
+         || be32(data + 8) < 13 || memcmp(data + 12, "IHDR", 4) != 0)
+        return false;
+
+    int const width = (int)be32(data + 16);
+    int const height = (int)be32(data + 20);
+    if (width <= 0 || height <= 0 || width > 0x4000 || height > 0x4000)
+        return false;
+
+    image_size = lol::ivec2(width, height);
+    return true;
+}
+
+bool decode_png(uint8_t const *data, size_t size, lol::ivec2 &image_size,
+                std::vector<lol::u8vec4> &pixels)
+{
+    if (size < 8 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0)
+        return false;
+
+    int width = 0, height = 0, channels = 0;
+    std::vector<uint8_t> idat;
+    uint8_t const *single_idat = nullptr;
+    size_t single_size = 0;
+    int idat_count = 0;
+
+    for (size_t pos = 8; pos + 12 <= size; )
+    {
+        uint32_t const len = be32(data + pos);
+        uint8_t const *type = data + pos + 4;
+        uint8_t const *chunk = data + pos + 8;
+        if (len > size - pos - 12)
+            return false;
+
+        if (memcmp(type, "IHDR", 4) == 0 && len >= 13)
+        {
+            width = (int)be32(chunk);
+            height = (int)be32(chunk + 4);
+            int const depth = chunk[8], color = chunk[9];
+            int const interlace = chunk[12];
+            if (depth != 8 || (color != 2 && color != 6) || interlace != 0
+                 || width <= 0 || height <= 0 || width > 0x4000 || height > 0x4000)
+                return false;
+            channels = color == 6 ? 4 : 3;
+        }
+        else if (memcmp(type, "IDAT", 4) == 0)
+        {
+            // Avoid a copy in the common case of a single IDAT chunk
+            if (idat_count++ == 0)
+            {
+                single_idat = chunk;
+                single_size = len;
+            }
+            else
+            {
+                if (idat_count == 2)
+                    idat.assign(single_idat, single_idat + single_size);
+                idat.insert(idat.end(), chunk, chunk + len);
+            }
+        }
+        else if (memcmp(type, "IEND", 4) == 0)
+        {
+            break;
+        }
+
+        pos += 12 + len;
+    }
+
+    if (!channels || !idat_count)
+        return false;
+
+    // Never inflate more than the image needs; a hostile stream could
+    // otherwise expand to gigabytes.
+    size_t const stride = (size_t)width * channels;
+    size_t const raw_size = (stride + 1) * height;
+    std::vector<uint8_t> raw;
+    raw.reserve(raw_size);
+    if (!inflate(idat_count > 1 ? idat.data() : single_idat,
+                 idat_count > 1 ? idat.size() : single_size, raw, raw_size)
+         || raw.size() < raw_size)
+        return false;
+
+    // Undo scanline filters in place
+    int const bpp = channels;
+    uint8_t *prev = nullptr;
+    for (int y = 0; y < height; ++y)
+    {
+        uint8_t *line = raw.data() + y * (stride + 1) + 1;
+        int const filter = line[-1];
+
+        switch (filter)
+        {
+        case 0: // None
+            break;
+        case 1: // Sub
+            for (size_t i = bpp; i < stride; ++i)
+                line[i] += line[i - bpp];
+            break;
+        case 2: // Up
+            if (prev)
+                for (size_t i = 0; i < stride; ++i)
+                    line[i] += prev[i];
+            break;
+        case 3: // Average
+            for (size_t i = 0; i < stride; ++i)
+            {
+                int a = i >= (size_t)bpp ? line[i - bpp] : 0;
+                int b = prev ? prev[i] : 0;
+                line[i] += (uint8_t)((a + b) >> 1);
+            }
+            break;
+        case 4: // Paeth
+            for (size_t i = 0; i < stride; ++i)
+            {
+                int a = i >= (size_t)bpp ? line[i - bpp] : 0;
+                int b = prev ? prev[i] : 0;
+                int c = prev && i >= (size_t)bpp ? prev[i - bpp] : 0;
+                int p = a + b - c;
+                int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                line[i] += (uint8_t)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+            }
+            break;
+        default:
+            return false;
+        }
+
+        prev = line;
+    }
+
+    image_size = lol::ivec2(width, height);
+    pixels.resize((size_t)width * height);
+    for (int y = 0; y < height; ++y)
+    {
+        uint8_t const *line = raw.data() + y * (stride + 1) + 1;
+        lol::u8vec4 *dst = pixels.data() + (size_t)y * width;
+        for (int x = 0; x < width; ++x, line += channels)
+            dst[x] = lol::u8vec4(line[0], line[1], line[2],
+                                 channels == 4 ? line[3] : 0xff);
+    }
+
+    return true;
+}
+
+std::mutex &image_lock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+} // namespace z8
+
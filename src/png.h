@@ -0,0 +1,50 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+// PNG decoding
+// ————————————
+// A minimal PNG decoder for cartridges, working directly on a memory
+// buffer. It only handles what PICO-8 writes: non-interlaced, 8-bit RGB
+// or RGBA images. Callers should fall back to lol::image for anything
+// else. The inflate() function decodes a raw zlib stream and fails if
+// the output would exceed max_size. The png_size() function only reads
+// the IHDR chunk, so that callers can reject images of the wrong size
+// before anything gets decompressed.
+//
+// lol::image keeps global codec state and is not thread-safe, so any
+// lol::image load, save or copy that may run on a thread pool worker
+// must hold image_lock().
+
+namespace z8
+{
+
+bool inflate(uint8_t const *data, size_t size, std::vector<uint8_t> &out,
+             size_t max_size = SIZE_MAX);
+
+bool png_size(uint8_t const *data, size_t size, lol::ivec2 &image_size);
+
+bool decode_png(uint8_t const *data, size_t size, lol::ivec2 &image_size,
+                std::vector<lol::u8vec4> &pixels);
+
+std::mutex &image_lock();
+
+} // namespace z8
+
@@ -16,11 +16,14 @@
 
 #include <lol/engine.h>
 
+#include <cstring> // memset
+
 extern "C" {
 #include "3rdparty/quickjs/quickjs.h"
 }
 
 #include "zepto8.h"
+#include "file.h"
 #include "raccoon/vm.h"
 #include "bios.h" // TODO: remove references to PICO-8 stuff
 #include "bindings/js.h"
@@ -48,25 +51,12 @@ vm::~vm()
 
 void vm::load(std::string const &file)
 {
-    std::string s;
-    lol::File f;
-    for (auto const &candidate : lol::sys::get_path_list(file))
-    {
-        f.Open(candidate, lol::FileAccess::Read);
-        if (f.IsValid())
-        {
-            s = f.ReadString();
-            f.Close();
-
-            lol::msg::debug("loaded file %s\n", candidate.c_str());
-            break;
-        }
-    }
-
-    if (s.length() == 0)
+    // The mapped data is NUL-terminated, as JS_ParseJSON() requires
+    mapped_file f;
+    if (!f.open(file) || f.size() == 0)
         return;
 
-    JSValue bin = JS_ParseJSON(m_ctx, s.c_str(), s.length(), file.c_str());
+    JSValue bin = JS_ParseJSON(m_ctx, (char const *)f.data(), f.size(), file.c_str());
     if (JS_IsException(bin))
     {
         dump_error(m_ctx);
@@ -232,6 +222,11 @@ std::function<void(void *, int)> vm::get_streamer(int channel)
     return [](void *, int) {};
 }
 
+std::function<void(void *, int)> vm::get_mixer()
+{
+    return [](void *buffer, int bytes) { memset(buffer, 0, bytes); };
+}
+
 std::tuple<uint8_t *, size_t> vm::ram()
 {
     return std::make_tuple(&m_ram[0], sizeof(m_ram));
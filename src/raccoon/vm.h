@@ -40,6 +40,7 @@ public:
     virtual std::string const &get_code() const;
 
     virtual std::function<void(void *, int)> get_streamer(int channel);
+    virtual std::function<void(void *, int)> get_mixer();
 
     virtual void button(int index, int state);
     virtual void mouse(lol::ivec2 coords, int buttons);
@@ -118,6 +119,9 @@ public:
         };
     };
 
+    // Instance of the above list owned by the JavaScript bindings
+    std::shared_ptr<void> m_js_lib;
+
 private:
     struct JSRuntime *m_rt;
     struct JSContext *m_ctx;
@@ -0,0 +1,281 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <cstring>
+
+#include "replay.h"
+
+namespace z8
+{
+
+static char const replay_magic[4] = { 'z', '8', 'i', 'n' };
+static int const replay_version = 1;
+
+enum : int
+{
+    has_buttons = 0x1,
+    has_mouse   = 0x2,
+    has_keys    = 0x4,
+};
+
+static void put_varint(FILE *fd, uint64_t x)
+{
+    for (; x >= 0x80; x >>= 7)
+        putc((int)(x & 0x7f) | 0x80, fd);
+    putc((int)x, fd);
+}
+
+static bool get_varint(FILE *fd, uint64_t &x)
+{
+    x = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int ch = getc(fd);
+        if (ch == EOF)
+            return false;
+        x |= (uint64_t)(ch & 0x7f) << shift;
+        if (!(ch & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Mouse movements are small signed numbers
+static uint64_t zigzag(int32_t x) { return ((uint32_t)x << 1) ^ (uint32_t)(x >> 31); }
+static int32_t unzigzag(uint64_t x) { return (int32_t)(x >> 1) ^ -(int32_t)(x & 1); }
+
+//
+// Writer
+//
+
+input_writer::~input_writer()
+{
+    close();
+}
+
+bool input_writer::open(char const *filename)
+{
+    close();
+
+    m_fd = fopen(filename, "wb");
+    if (!m_fd)
+        return false;
+
+    fwrite(replay_magic, sizeof(replay_magic), 1, m_fd);
+    putc(replay_version, m_fd);
+
+    m_frame = m_last_frame = 0;
+    m_buttons = m_prev_buttons = 0;
+    m_mouse = m_prev_mouse = lol::ivec2(0);
+    m_mouse_buttons = m_prev_mouse_buttons = 0;
+    m_has_mouse = m_prev_has_mouse = false;
+    m_keys.clear();
+    return true;
+}
+
+void input_writer::close()
+{
+    if (!m_fd)
+        return;
+
+    // The end marker also tells how many frames were recorded
+    put_varint(m_fd, m_frame - m_last_frame);
+    putc(0, m_fd);
+
+    fclose(m_fd);
+    m_fd = nullptr;
+}
+
+void input_writer::button(int index, int state)
+{
+    if (m_fd && state && index >= 0 && index < 64)
+        m_buttons |= (uint64_t)1 << index;
+}
+
+void input_writer::mouse(lol::ivec2 coords, int buttons)
+{
+    if (!m_fd)
+        return;
+
+    m_mouse = coords;
+    m_mouse_buttons = buttons;
+    m_has_mouse = true;
+}
+
+void input_writer::keyboard(char ch)
+{
+    if (m_fd)
+        m_keys += ch;
+}
+
+void input_writer::next_frame()
+{
+    if (!m_fd)
+        return;
+
+    int flags = (m_buttons != m_prev_buttons ? has_buttons : 0)
+              | (m_has_mouse && (!m_prev_has_mouse || m_mouse != m_prev_mouse
+                   || m_mouse_buttons != m_prev_mouse_buttons) ? has_mouse : 0)
+              | (m_keys.length() ? has_keys : 0);
+
+    if (flags)
+    {
+        put_varint(m_fd, m_frame - m_last_frame);
+        putc(flags, m_fd);
+        if (flags & has_buttons)
+            put_varint(m_fd, m_buttons ^ m_prev_buttons);
+        if (flags & has_mouse)
+        {
+            put_varint(m_fd, zigzag(m_mouse.x - m_prev_mouse.x));
+            put_varint(m_fd, zigzag(m_mouse.y - m_prev_mouse.y));
+            putc(m_mouse_buttons, m_fd);
+        }
+        if (flags & has_keys)
+        {
+            put_varint(m_fd, m_keys.length());
+            fwrite(m_keys.data(), 1, m_keys.length(), m_fd);
+        }
+        m_last_frame = m_frame;
+    }
+
+    // Buttons and keys are sampled again every frame; the mouse state
+    // stays until it is updated.
+    m_prev_buttons = m_buttons;
+    m_prev_mouse = m_mouse;
+    m_prev_mouse_buttons = m_mouse_buttons;
+    m_prev_has_mouse = m_has_mouse;
+    m_buttons = 0;
+    m_keys.clear();
+    ++m_frame;
+}
+
+//
+// Reader
+//
+
+input_reader::~input_reader()
+{
+    close();
+}
+
+bool input_reader::open(char const *filename)
+{
+    close();
+
+    m_fd = fopen(filename, "rb");
+    if (!m_fd)
+        return false;
+
+    char magic[sizeof(replay_magic)];
+    if (fread(magic, sizeof(magic), 1, m_fd) != 1
+         || memcmp(magic, replay_magic, sizeof(magic)) != 0
+         || getc(m_fd) != replay_version)
+    {
+        lol::msg::error("invalid input recording %s\n", filename);
+        close();
+        return false;
+    }
+
+    m_frame = m_next_frame = 0;
+    m_buttons = 0;
+    m_mouse = lol::ivec2(0);
+    m_mouse_buttons = 0;
+    m_has_mouse = false;
+    read_record();
+    return true;
+}
+
+void input_reader::close()
+{
+    if (m_fd)
+        fclose(m_fd);
+    m_fd = nullptr;
+}
+
+// Read the header of the next record; its data is read when the
+// corresponding frame is reached.
+void input_reader::read_record()
+{
+    uint64_t delta;
+    int flags;
+    if (!get_varint(m_fd, delta) || (flags = getc(m_fd)) == EOF)
+    {
+        // Recordings from sessions that were killed have no end marker;
+        // stop after the last complete record.
+        m_next_frame = m_frame + 1;
+        m_flags = 0;
+        return;
+    }
+
+    m_next_frame += (uint32_t)delta;
+    m_flags = flags;
+}
+
+// Decode the input state for the current frame
+bool input_reader::read_frame()
+{
+    if (!m_fd)
+        return false;
+
+    m_keys.clear();
+
+    if (m_frame == m_next_frame)
+    {
+        if (m_flags == 0)
+        {
+            close();
+            return false;
+        }
+
+        uint64_t x = 0, y = 0;
+        int b = 0;
+        bool ok = true;
+        if (m_flags & has_buttons)
+        {
+            ok = get_varint(m_fd, x);
+            m_buttons ^= x;
+        }
+        if (ok && (m_flags & has_mouse))
+        {
+            ok = get_varint(m_fd, x) && get_varint(m_fd, y) && (b = getc(m_fd)) != EOF;
+            m_mouse.x += unzigzag(x);
+            m_mouse.y += unzigzag(y);
+            m_mouse_buttons = b;
+            m_has_mouse = true;
+        }
+        if (ok && (m_flags & has_keys))
+        {
+            ok = get_varint(m_fd, x) && x < 0x10000;
+            m_keys.resize(ok ? (size_t)x : 0);
+            ok = ok && fread(&m_keys[0], 1, m_keys.length(), m_fd) == m_keys.length();
+        }
+
+        if (!ok)
+        {
+            lol::msg::error("truncated input recording\n");
+            close();
+            return false;
+        }
+
+        read_record();
+    }
+
+    ++m_frame;
+    return true;
+}
+
+} // namespace z8
+
@@ -0,0 +1,108 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+
+#include "zepto8.h"
+
+// The input_writer and input_reader classes
+// —————————————————————————————————————————
+// Record the input given to a VM, frame by frame, and play it back later.
+// Only frames where something changed are stored: each record is the
+// number of frames since the previous record, a byte of flags, then the
+// XOR of the button bits, the mouse movement and button state, and the
+// characters typed during that frame. A record with no flags marks the
+// end of the recording. Numbers are stored as LEB128 varints, so a long
+// session with little input takes a few bytes per second.
+
+namespace z8
+{
+
+class input_writer
+{
+public:
+    ~input_writer();
+
+    bool open(char const *filename);
+    void close();
+    bool is_open() const { return m_fd != nullptr; }
+
+    // Same semantics as the vm_base methods; these do nothing if no
+    // file is open, so callers may use them unconditionally.
+    void button(int index, int state);
+    void mouse(lol::ivec2 coords, int buttons);
+    void keyboard(char ch);
+
+    // Store the changes since the previous frame
+    void next_frame();
+
+private:
+    FILE *m_fd = nullptr;
+    uint32_t m_frame = 0, m_last_frame = 0;
+
+    uint64_t m_buttons = 0, m_prev_buttons = 0;
+    lol::ivec2 m_mouse, m_prev_mouse;
+    int m_mouse_buttons = 0, m_prev_mouse_buttons = 0;
+    bool m_has_mouse = false, m_prev_has_mouse = false;
+    std::string m_keys;
+};
+
+class input_reader
+{
+public:
+    ~input_reader();
+
+    bool open(char const *filename);
+    void close();
+    bool is_open() const { return m_fd != nullptr; }
+
+    // Feed the next frame of input to the VM. Returns false once the
+    // recording is over, or if the file is truncated or corrupted. Any
+    // VM type with the vm_base input methods will do.
+    template<typename T> bool next_frame(T &vm)
+    {
+        if (!read_frame())
+            return false;
+
+        for (int i = 0; i < 64; ++i)
+            if (m_buttons & ((uint64_t)1 << i))
+                vm.button(i, 1);
+        if (m_has_mouse)
+            vm.mouse(m_mouse, m_mouse_buttons);
+        for (char ch : m_keys)
+            vm.keyboard(ch);
+        return true;
+    }
+
+private:
+    bool read_frame();
+    void read_record();
+
+    FILE *m_fd = nullptr;
+    uint32_t m_frame = 0, m_next_frame = 0;
+    int m_flags = 0;
+
+    uint64_t m_buttons = 0;
+    lol::ivec2 m_mouse;
+    int m_mouse_buttons = 0;
+    bool m_has_mouse = false;
+    std::string m_keys;
+};
+
+} // namespace z8
+
@@ -0,0 +1,121 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <numeric> // std::gcd
+#include <cmath>
+
+#include "resampler.h"
+
+namespace z8
+{
+
+resampler::resampler(std::function<void(void *, int)> source,
+                     int in_rate, int out_rate, int quality)
+  : m_source(source),
+    m_in_rate(lol::max(1, in_rate)),
+    m_out_rate(lol::max(1, out_rate))
+{
+    int g = std::gcd(m_in_rate, m_out_rate);
+    m_up = m_out_rate / g;
+    m_down = m_in_rate / g;
+    m_taps = 4 << lol::clamp(quality, 0, 4);
+
+    // Cutoff frequency as a fraction of the upsampled rate, with a bit of
+    // headroom for the transition band.
+    double const pi = 3.14159265358979323846;
+    double const fc = 0.5 * 0.9 / lol::max(m_up, m_down);
+    int const len = m_up * m_taps;
+    double const center = 0.5 * (len - 1);
+
+    // Design the prototype filter (Blackman-windowed sinc), then store it
+    // so that the taps of each phase are contiguous.
+    m_coeffs.resize(len);
+    for (int n = 0; n < len; ++n)
+    {
+        double x = n - center;
+        double sinc = x == 0.0 ? 2.0 * fc : std::sin(2.0 * pi * fc * x) / (pi * x);
+        double w = 0.42 - 0.5 * std::cos(2.0 * pi * (n + 0.5) / len)
+                        + 0.08 * std::cos(4.0 * pi * (n + 0.5) / len);
+        int phase = n % m_up, k = n / m_up;
+        m_coeffs[phase * m_taps + k] = float(sinc * w * m_up);
+    }
+
+    // Start with a silent history
+    m_input.assign(m_taps - 1, 0.f);
+    m_pos = m_taps - 1;
+}
+
+std::function<void(void *, int)> resampler::get_streamer()
+{
+    using namespace std::placeholders;
+    return std::bind(&resampler::operator(), this, _1, _2);
+}
+
+void resampler::operator()(void *in_buffer, int in_bytes)
+{
+    int16_t *buffer = (int16_t *)in_buffer;
+    int const samples = in_bytes / 2;
+
+    if (samples <= 0)
+        return;
+
+    // Nothing to do if the rates match
+    if (m_up == m_down)
+    {
+        m_source(in_buffer, samples * 2);
+        return;
+    }
+
+    // Pull exactly as many input samples as the output block needs
+    int last = m_pos + (m_phase + (samples - 1) * m_down) / m_up;
+    int needed = last + 1 - (int)m_input.size();
+    if (needed > 0)
+    {
+        if ((int)m_scratch.size() < needed)
+            m_scratch.resize(needed);
+        m_source(m_scratch.data(), needed * 2);
+        for (int i = 0; i < needed; ++i)
+            m_input.push_back(m_scratch[i]);
+    }
+
+    for (int i = 0; i < samples; ++i)
+    {
+        float const *h = m_coeffs.data() + m_phase * m_taps;
+        float const *x = m_input.data() + m_pos;
+        float acc = 0.f;
+        for (int k = 0; k < m_taps; ++k)
+            acc += h[k] * x[-k];
+
+        buffer[i] = (int16_t)std::min(std::max(std::lrint(acc), -32768l), 32767l);
+
+        m_phase += m_down;
+        m_pos += m_phase / m_up;
+        m_phase %= m_up;
+    }
+
+    // Only keep the history needed by the next output sample
+    int drop = m_pos - (m_taps - 1);
+    if (drop > 0)
+    {
+        m_input.erase(m_input.begin(), m_input.begin() + drop);
+        m_pos -= drop;
+    }
+}
+
+} // namespace z8
+
@@ -0,0 +1,67 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <cstdint>
+
+// The resampler class
+// ———————————————————
+// Wraps a mono S16 audio source running at one rate and exposes it as a
+// source running at another rate. It uses a polyphase windowed-sinc filter:
+// the ratio is reduced to L/M, a single low-pass prototype is designed at
+// L times the input rate, and each output sample is computed with only the
+// taps of the phase it falls on. The cutoff sits just below the Nyquist
+// frequency of the slower of the two rates, which removes both the images
+// of upsampling and the aliases of downsampling.
+//
+// The quality setting trades CPU for stopband attenuation and transition
+// width: quality q uses 4 << q taps per output sample (q = 0…4).
+
+namespace z8
+{
+
+class resampler
+{
+public:
+    resampler(std::function<void(void *, int)> source,
+              int in_rate, int out_rate, int quality = 2);
+
+    // Same signature as the audio streaming callbacks
+    void operator()(void *buffer, int bytes);
+
+    std::function<void(void *, int)> get_streamer();
+
+    int in_rate() const { return m_in_rate; }
+    int out_rate() const { return m_out_rate; }
+
+private:
+    std::function<void(void *, int)> m_source;
+    int m_in_rate, m_out_rate;
+
+    // Upsampling factor, downsampling factor, and taps per phase
+    int m_up, m_down, m_taps;
+
+    // Filter coefficients, stored phase by phase
+    std::vector<float> m_coeffs;
+
+    // Input history; m_input[m_pos] is the newest sample used by the next
+    // output sample, and m_phase its position between two input samples.
+    std::vector<float> m_input;
+    std::vector<int16_t> m_scratch;
+    int m_pos = 0, m_phase = 0;
+};
+
+} // namespace z8
+
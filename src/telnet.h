@@ -23,6 +23,7 @@
 
 #include "zepto8.h"
 #include "pico8/vm.h"
+#include "replay.h"
 
 // The telnet class
 // ————————————————
@@ -35,8 +36,12 @@ struct telnet
 {
     lol::array<uint8_t> m_screen;
     lol::ivec2 m_term_size = lol::ivec2(128, 64);
+    std::string m_seq;
 
-    void run(char const *cart)
+    // Optionally save the input to a file, or read it from a file; the
+    // keyboard is ignored until the end of the replayed recording.
+    void run(char const *cart, char const *record = nullptr,
+             char const *replay = nullptr)
     {
         disable_echo();
 
@@ -44,8 +49,21 @@ struct telnet
         vm.load(cart);
         vm.run();
 
+        input_writer writer;
+        input_reader reader;
+        if (record)
+            writer.open(record);
+        if (replay)
+            reader.open(replay);
+
         auto const &ram = vm.ram();
 
+        auto button = [&](int index)
+        {
+            vm.button(index, 1);
+            writer.button(index, 1);
+        };
+
         while (true)
         {
             lol::timer t;
@@ -53,41 +71,50 @@ struct telnet
             for (int i = 0; i < 16; ++i)
                 vm.button(i, 0);
 
+            bool replaying = reader.is_open() && reader.next_frame(vm);
+
             for (;;)
             {
                 int key = get_key();
                 if (key < 0)
                     break;
 
+                // Only Escape works during a replay
+                if (replaying && key != 0x1b)
+                    continue;
+
                 switch (key)
                 {
                     /* For now, Escape quits */
                     case 0x1b: return;
 
-                    case 0x144: vm.button(0, 1); break; // left
-                    case 0x143: vm.button(1, 1); break; // right
-                    case 0x141: vm.button(2, 1); break; // up
-                    case 0x142: vm.button(3, 1); break; // down
+                    case 0x144: button(0); break; // left
+                    case 0x143: button(1); break; // right
+                    case 0x141: button(2); break; // up
+                    case 0x142: button(3); break; // down
                     case 'z': case 'Z':
                     case 'c': case 'C':
-                    case 'n': case 'N': vm.button(4, 1); break;
+                    case 'n': case 'N': button(4); break;
                     case 'x': case 'X':
                     case 'v': case 'V':
-                    case 'm': case 'M': vm.button(5, 1); break;
-                    case '\r': case '\n': vm.button(6, 1); break;
-                    case 's': case 'S': vm.button(8, 1); break;
-                    case 'f': case 'F': vm.button(9, 1); break;
-                    case 'e': case 'E': vm.button(10, 1); break;
-                    case 'd': case 'D': vm.button(11, 1); break;
-                    case 'a': case 'A': vm.button(12, 1); break;
+                    case 'm': case 'M': button(5); break;
+                    case '\r': case '\n': button(6); break;
+                    case 's': case 'S': button(8); break;
+                    case 'f': case 'F': button(9); break;
+                    case 'e': case 'E': button(10); break;
+                    case 'd': case 'D': button(11); break;
+                    case 'a': case 'A': button(12); break;
                     case '\t':
-                    case 'q': case 'Q': vm.button(13, 1); break;
+                    case 'q': case 'Q': button(13); break;
                     default:
                         lol::msg::info("Got unknown key %02x\n", key);
                         break;
                 }
             }
 
+            if (!replaying)
+                writer.next_frame();
+
             vm.step(1.f / 60.f);
 
             vm.print_ansi(m_term_size,
@@ -119,8 +146,6 @@ struct telnet
     int get_key()
     {
 #if HAVE_UNISTD_H
-        static std::string seq;
-
         fd_set fds;
         FD_ZERO(&fds);
         FD_SET(STDIN_FILENO, &fds);
@@ -137,35 +162,35 @@ struct telnet
         if (read(STDIN_FILENO, &ch, 1) <= 0)
             exit(EXIT_SUCCESS);
 
-        if (ch != '\x1b' && ch != '\xff' && seq.length() == 0)
+        if (ch != '\x1b' && ch != '\xff' && m_seq.length() == 0)
             return ch;
 
-        seq += ch;
+        m_seq += ch;
 
         // TELNET commands
-        if (seq[0] == '\xff') // telnet commands
+        if (m_seq[0] == '\xff') // telnet commands
         {
-            if (seq[1] >= '\xfb' && seq[1] <= '\xfe')
+            if (m_seq[1] >= '\xfb' && m_seq[1] <= '\xfe')
             {
-                if (seq[2] == 0)
+                if (m_seq[2] == 0)
                     return -1; // wait for more data
                 goto reset;
             }
-            else if (seq[1] == '\xfa') // subnegociation
+            else if (m_seq[1] == '\xfa') // subnegociation
             {
-                if (seq[2] == 0)
+                if (m_seq[2] == 0)
                     return -1; // wait for more data
-                if (seq[2] != '\x1f')
+                if (m_seq[2] != '\x1f')
                     goto reset; // can’t happen
-                if (seq.length() < 9)
+                if (m_seq.length() < 9)
                     return -1; // wait for more data
-                m_term_size.x = (uint8_t)seq[3] * 256 + (uint8_t)seq[4];
-                m_term_size.y = (uint8_t)seq[5] * 256 + (uint8_t)seq[6];
+                m_term_size.x = (uint8_t)m_seq[3] * 256 + (uint8_t)m_seq[4];
+                m_term_size.y = (uint8_t)m_seq[5] * 256 + (uint8_t)m_seq[6];
                 printf("\x1b[2J"); // clear screen
                 m_screen.clear();
                 goto reset;
             }
-            else if (seq.length() >= 3)
+            else if (m_seq.length() >= 3)
             {
                 goto reset;
             }
@@ -174,19 +199,19 @@ struct telnet
         }
 
         // Escape sequences
-        if (seq[0] == '\x1b')
+        if (m_seq[0] == '\x1b')
         {
-            if (seq[1] == '\x5b')
+            if (m_seq[1] == '\x5b')
             {
-                if (seq[2] == 0)
+                if (m_seq[2] == 0)
                     return -1; // wait for more data
-                int ret = 0x100 + seq[2];
-                seq = "";
+                int ret = 0x100 + m_seq[2];
+                m_seq = "";
                 return ret;
             }
-            else if (seq[1] == '\x1b')
+            else if (m_seq[1] == '\x1b')
             {
-                seq = "";
+                m_seq = "";
                 return '\x1b';
             }
 
@@ -194,7 +219,7 @@ struct telnet
         }
 
 reset:
-        seq = "";
+        m_seq = "";
 #endif
         return -1;
     }
@@ -0,0 +1,147 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm>
+
+#include "threadpool.h"
+
+namespace z8
+{
+
+thread_pool::thread_pool(int count)
+{
+    if (count <= 0)
+        count = std::max(1, (int)std::thread::hardware_concurrency());
+
+    for (int i = 0; i < count; ++i)
+        m_queues.push_back(std::make_unique<queue>());
+    for (int i = 0; i < count; ++i)
+        m_threads.emplace_back(&thread_pool::worker, this, i);
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (auto &t : m_threads)
+        t.join();
+}
+
+void thread_pool::push(std::function<void()> task)
+{
+    size_t const index = m_next++ % m_queues.size();
+    ++m_pending;
+
+    {
+        std::lock_guard<std::mutex> lock(m_queues[index]->lock);
+        m_queues[index]->tasks.push_back(std::move(task));
+    }
+
+    // Only announce the task once it can actually be found. A worker
+    // increments m_sleeping before checking m_queued, so either it sees
+    // the new task or we see it sleeping; taking the lock ensures it is
+    // actually waiting before we notify it.
+    ++m_queued;
+    if (m_sleeping > 0)
+    {
+        { std::lock_guard<std::mutex> lock(m_lock); }
+        m_wake.notify_one();
+    }
+}
+
+void thread_pool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_idle.wait(lock, [this]() { return m_pending == 0; });
+}
+
+// Reserve one of the announced tasks for the calling worker
+bool thread_pool::claim()
+{
+    size_t n = m_queued;
+    while (n > 0)
+        if (m_queued.compare_exchange_weak(n, n - 1))
+            return true;
+    return false;
+}
+
+bool thread_pool::pop(int index, std::function<void()> &task)
+{
+    int const count = (int)m_queues.size();
+
+    for (int i = 0; i < count; ++i)
+    {
+        queue &q = *m_queues[(index + i) % count];
+        std::lock_guard<std::mutex> lock(q.lock);
+        if (q.tasks.empty())
+            continue;
+
+        // Newest task from our own queue, oldest task from the others
+        if (i == 0)
+        {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void thread_pool::worker(int index)
+{
+    for (;;)
+    {
+        if (!claim())
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            ++m_sleeping;
+            m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+            --m_sleeping;
+            // Another worker may have claimed the task that woke us up,
+            // so only leave when the pool is really being destroyed
+            if (m_stop && m_queued == 0)
+                return;
+            continue;
+        }
+
+        // A task was announced and reserved for us, so it can always be
+        // found in one of the queues.
+        std::function<void()> task;
+        while (!pop(index, task))
+            std::this_thread::yield();
+
+        task();
+
+        if (--m_pending == 0)
+        {
+            { std::lock_guard<std::mutex> lock(m_lock); }
+            m_idle.notify_all();
+        }
+    }
+}
+
+} // namespace z8
+
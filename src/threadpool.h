@@ -0,0 +1,91 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <cstddef>
+
+// The thread_pool class
+// —————————————————————
+// A fixed set of worker threads, each with its own task queue. Tasks are
+// spread over the queues in round-robin order; a worker takes tasks from
+// the back of its own queue and, once it is empty, steals from the front
+// of the other queues. This keeps every core busy even when task sizes
+// vary a lot, e.g. a catalogue with a few very large cartridges.
+// Only the per-queue locks are taken on the hot path; the pool-wide lock
+// is only used by threads that go to sleep or wake others up.
+
+namespace z8
+{
+
+class thread_pool
+{
+public:
+    // Use as many threads as there are hardware threads if count is 0
+    explicit thread_pool(int count = 0);
+    ~thread_pool();
+
+    thread_pool(thread_pool const &) = delete;
+    thread_pool &operator =(thread_pool const &) = delete;
+
+    int size() const { return (int)m_threads.size(); }
+
+    void push(std::function<void()> task);
+
+    // Block until all queued tasks have completed
+    void wait();
+
+private:
+    void worker(int index);
+    bool claim();
+    bool pop(int index, std::function<void()> &task);
+
+    struct queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<queue>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    // Tasks that are in a queue but not yet claimed by a worker, tasks
+    // that have not completed yet, and the next queue to push to.
+    std::atomic<size_t> m_queued{0}, m_pending{0}, m_next{0};
+
+    // Only needed to sleep and wake up; m_stop is protected by m_lock
+    std::mutex m_lock;
+    std::condition_variable m_wake, m_idle;
+    std::atomic<int> m_sleeping{0};
+    bool m_stop = false;
+};
+
+// Call fn(i) for all i in [0, count) using the pool, and wait for the
+// calls to complete.
+template<typename T>
+void parallel_for(thread_pool &pool, size_t count, T const &fn)
+{
+    for (size_t i = 0; i < count; ++i)
+        pool.push([&fn, i]() { fn(i); });
+    pool.wait();
+}
+
+} // namespace z8
+
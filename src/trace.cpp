@@ -0,0 +1,172 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+
+namespace z8::trace
+{
+
+struct event
+{
+    char const *name;
+    uint64_t start, duration;
+    bool instant;
+};
+
+// Only the owning thread writes to a buffer, but flush() may read it at
+// the same time, and the writer may wrap around and overwrite the slot
+// being read. Each slot is therefore a small seqlock: its sequence number
+// is odd while event n is being written and 2n + 2 once it is stored, so
+// a reader can tell a torn or overwritten slot and skip it.
+struct buffer
+{
+    static size_t const capacity = 1 << 16;
+
+    struct slot
+    {
+        std::atomic<uint64_t> seq { 0 };
+        std::atomic<char const *> name { nullptr };
+        std::atomic<uint64_t> start { 0 }, duration { 0 };
+        std::atomic<bool> instant { false };
+    };
+
+    void push(event const &e)
+    {
+        uint64_t n = count.load(std::memory_order_relaxed);
+        slot &s = slots[n % capacity];
+        s.seq.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.name.store(e.name, std::memory_order_relaxed);
+        s.start.store(e.start, std::memory_order_relaxed);
+        s.duration.store(e.duration, std::memory_order_relaxed);
+        s.instant.store(e.instant, std::memory_order_relaxed);
+        s.seq.store(2 * n + 2, std::memory_order_release);
+        count.store(n + 1, std::memory_order_release);
+    }
+
+    // Read event n, unless it was overwritten or is being written
+    bool read(uint64_t n, event &e) const
+    {
+        slot const &s = slots[n % capacity];
+        if (s.seq.load(std::memory_order_acquire) != 2 * n + 2)
+            return false;
+        e.name = s.name.load(std::memory_order_relaxed);
+        e.start = s.start.load(std::memory_order_relaxed);
+        e.duration = s.duration.load(std::memory_order_relaxed);
+        e.instant = s.instant.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s.seq.load(std::memory_order_relaxed) == 2 * n + 2;
+    }
+
+    std::unique_ptr<slot[]> slots { new slot[capacity] };
+    std::atomic<uint64_t> count { 0 };
+    int tid = 0;
+};
+
+// Buffers are never freed, so that the events of threads that are
+// gone can still be flushed. The mutex only protects the list.
+static std::mutex g_mutex;
+static std::vector<std::shared_ptr<buffer>> g_buffers;
+
+static buffer &local_buffer()
+{
+    thread_local std::shared_ptr<buffer> b = []()
+    {
+        auto ret = std::make_shared<buffer>();
+        std::lock_guard<std::mutex> lock(g_mutex);
+        ret->tid = (int)g_buffers.size() + 1;
+        g_buffers.push_back(ret);
+        return ret;
+    }();
+    return *b;
+}
+
+bool enabled()
+{
+#if ENABLE_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t now()
+{
+    using clock = std::chrono::steady_clock;
+    static auto const epoch = clock::now();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               clock::now() - epoch).count();
+}
+
+void complete(char const *name, uint64_t start)
+{
+    local_buffer().push(event { name, start, now() - start, false });
+}
+
+void instant(char const *name)
+{
+    local_buffer().push(event { name, now(), 0, true });
+}
+
+bool flush(std::string const &filename)
+{
+    FILE *fd = fopen(filename.c_str(), "w");
+    if (!fd)
+    {
+        lol::msg::error("cannot write trace to %s\n", filename.c_str());
+        return false;
+    }
+
+    // Timestamps are in microseconds
+    fprintf(fd, "{\"traceEvents\": [\n");
+    char const *sep = "";
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (auto const &b : g_buffers)
+    {
+        uint64_t end = b->count.load(std::memory_order_acquire);
+        uint64_t begin = end > buffer::capacity ? end - buffer::capacity : 0;
+        for (uint64_t n = begin; n < end; ++n)
+        {
+            event e;
+            if (!b->read(n, e))
+                continue;
+            if (e.instant)
+                fprintf(fd, "%s{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", "
+                            "\"ts\": %.3f, \"pid\": 1, \"tid\": %d}",
+                        sep, e.name, e.start * 1e-3, b->tid);
+            else
+                fprintf(fd, "%s{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+                            "\"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+                        sep, e.name, e.start * 1e-3, e.duration * 1e-3, b->tid);
+            sep = ",\n";
+        }
+    }
+    fprintf(fd, "\n]}\n");
+    fclose(fd);
+    return true;
+}
+
+} // namespace z8::trace
+
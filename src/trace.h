@@ -0,0 +1,75 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+// The trace module
+// ————————————————
+// Scoped markers that record a timeline of what happens during a frame,
+// saved in the Chrome trace event format that chrome://tracing and
+// Perfetto can open. Each thread appends its events to its own ring
+// buffer without taking any lock, and flush() writes all buffers to a
+// file at any time, even while other threads are still recording; it
+// skips the events that are overwritten while it reads them. Only the
+// most recent events of each thread are kept.
+//
+// Markers are only compiled in when building with --enable-trace; the
+// macros expand to nothing otherwise. Event names are not copied, so
+// they must be string literals or live as long as the program.
+
+#if ENABLE_TRACE
+#   define Z8_TRACE_CAT2(a, b) a##b
+#   define Z8_TRACE_CAT(a, b) Z8_TRACE_CAT2(a, b)
+#   define Z8_TRACE_SCOPE(name) \
+        z8::trace::scope Z8_TRACE_CAT(z8_trace_scope_, __LINE__)(name)
+#   define Z8_TRACE_INSTANT(name) z8::trace::instant(name)
+#else
+#   define Z8_TRACE_SCOPE(name) (void)0
+#   define Z8_TRACE_INSTANT(name) (void)0
+#endif
+
+namespace z8::trace
+{
+
+// Whether markers were compiled in
+bool enabled();
+
+// Nanoseconds since the program started
+uint64_t now();
+
+// Record an event that started at “start” and ends now, or a single
+// point in time
+void complete(char const *name, uint64_t start);
+void instant(char const *name);
+
+// Write the events of all threads to a JSON file
+bool flush(std::string const &filename);
+
+class scope
+{
+public:
+    scope(char const *name)
+      : m_name(name), m_start(now())
+    {}
+
+    ~scope() { complete(m_name, m_start); }
+
+private:
+    char const *m_name;
+    uint64_t m_start;
+};
+
+} // namespace z8::trace
+
@@ -0,0 +1,102 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+#include "wav.h"
+
+namespace z8
+{
+
+wav_writer::~wav_writer()
+{
+    close();
+}
+
+bool wav_writer::open(char const *filename, int rate, int channels, bool raw)
+{
+    close();
+
+    m_owned = filename && strcmp(filename, "-") != 0;
+    m_fd = m_owned ? fopen(filename, "wb") : stdout;
+    if (!m_fd)
+        return false;
+
+    m_raw = raw;
+    m_rate = rate;
+    m_channels = channels;
+    m_bytes = 0;
+
+    // Write a header with unknown sizes; close() will fix it if possible
+    if (!m_raw)
+        write_header(0xffffffff - 36);
+
+    return true;
+}
+
+void wav_writer::write(int16_t const *samples, size_t count)
+{
+    if (!m_fd)
+        return;
+
+    // PCM data in WAV files is little endian, and so are all the hosts we
+    // run on, so we can write the samples directly.
+    fwrite(samples, sizeof(*samples), count, m_fd);
+    m_bytes += count * sizeof(*samples);
+}
+
+void wav_writer::close()
+{
+    if (!m_fd)
+        return;
+
+    // Seeking fails on pipes; in that case just keep the streaming header
+    if (!m_raw && fseek(m_fd, 0, SEEK_SET) == 0)
+        write_header((uint32_t)std::min(m_bytes, (size_t)0xffffffff - 36));
+
+    if (m_owned)
+        fclose(m_fd);
+    else
+        fflush(m_fd);
+
+    m_fd = nullptr;
+}
+
+void wav_writer::write_header(uint32_t data_bytes)
+{
+    auto u16 = [](uint8_t *p, uint32_t x) { p[0] = (uint8_t)x; p[1] = (uint8_t)(x >> 8); };
+    auto u32 = [&](uint8_t *p, uint32_t x) { u16(p, x); u16(p + 2, x >> 16); };
+
+    uint8_t header[44] = {};
+    memcpy(header, "RIFF", 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    memcpy(header + 36, "data", 4);
+    u32(header + 4, 36 + data_bytes);   // chunk size
+    u32(header + 16, 16);               // subchunk size
+    u16(header + 20, 1);                // format (PCM)
+    u16(header + 22, m_channels);       // channels
+    u32(header + 24, m_rate);           // sample rate
+    u32(header + 28, m_rate * m_channels * 2); // byte rate
+    u16(header + 32, m_channels * 2);   // block align
+    u16(header + 34, 16);               // bits per sample
+    u32(header + 40, data_bytes);       // bytes in data
+
+    fwrite(header, sizeof(header), 1, m_fd);
+}
+
+} // namespace z8
+
@@ -0,0 +1,53 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+// The wav_writer class
+// ————————————————————
+// Streams signed 16-bit PCM samples to a file, either as a WAV file or as
+// raw PCM. The WAV header is written first with placeholder sizes and is
+// fixed when the file is closed. If the output cannot be seeked (e.g. a
+// pipe) the sizes are left at their maximum value, which most readers
+// understand as “read until the end of the stream”.
+
+namespace z8
+{
+
+class wav_writer
+{
+public:
+    wav_writer() = default;
+    ~wav_writer();
+
+    // Use a null or "-" filename to write to stdout
+    bool open(char const *filename, int rate, int channels, bool raw = false);
+    void write(int16_t const *samples, size_t count);
+    void close();
+
+    size_t frames() const { return m_bytes / (2 * m_channels); }
+
+private:
+    void write_header(uint32_t data_bytes);
+
+    FILE *m_fd = nullptr;
+    bool m_raw = false, m_owned = false;
+    int m_rate = 0, m_channels = 1;
+    size_t m_bytes = 0;
+};
+
+} // namespace z8
+
@@ -0,0 +1,791 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "zepto8.h"
+#include "file.h"
+#include "pico8/vm.h"
+#include "pico8/cart.h"
+#include "compress.h"
+#include "dither.h"
+#include "minify.h"
+
+// The bench class
+// ———————————————
+// Micro-benchmarks for the PICO-8 API. This is a friend of pico8::vm so
+// that it can call the api_* methods directly, without going through Lua,
+// and measure the cost of the rasterizer alone.
+//
+// The cart benchmarks run whole carts headless, with the virtual clock,
+// a fixed seed and a fixed input script, so that every run executes the
+// same Lua code. Besides the wall time they report the Lua instructions,
+// API calls and allocations per frame, which do not depend on the load
+// of the machine and tell why a cart got faster or slower.
+//
+// The codec benchmarks time the offline tools (cart loading and saving,
+// code compression, minification, dithering) on the carts in carts/ and
+// on a generated cart, and also report their throughput in MB/s. This
+// is also a friend of pico8::cart, for the format-specific loaders.
+
+namespace z8
+{
+
+using pico8::opt;
+
+class bench
+{
+public:
+    struct result
+    {
+        std::string name;
+        int64_t iterations;
+        // Nanoseconds per operation
+        double median, mean, stddev, min;
+        // Per frame, for cart benchmarks only
+        double instructions = 0, api_calls = 0, allocs = 0;
+        // Input bytes per second, for codec benchmarks only
+        double throughput = 0;
+    };
+
+    bench(int runs, double min_time, std::string const &filter)
+      : m_runs(runs), m_min_time(min_time), m_filter(filter)
+    {}
+
+    std::vector<result> const &results() const { return m_results; }
+
+    void micro();
+    void carts(std::vector<std::string> const &files, int frames);
+    void codecs(std::vector<std::string> const &files);
+
+    // Not a benchmark: check code compression against a brute force
+    // search, and return the number of carts that fail
+    static int check_compress(std::vector<std::string> const &files);
+
+private:
+    // Call fn(i) for increasing i until one run takes at least m_min_time,
+    // then time m_runs such runs. If bytes is not zero, it is the amount
+    // of data processed by one call, and the throughput is reported.
+    void measure(std::string const &name, std::function<void(int)> const &fn,
+                 size_t bytes = 0);
+    static void summarize(result &r, std::vector<double> &ns);
+    static bool decompresses_to(std::vector<uint8_t> const &data, std::string const &code);
+
+    int m_runs;
+    double m_min_time;
+    std::string m_filter;
+    std::vector<result> m_results;
+};
+
+void bench::measure(std::string const &name, std::function<void(int)> const &fn,
+                    size_t bytes)
+{
+    using clock = std::chrono::steady_clock;
+
+    if (m_filter.size() && name.find(m_filter) == std::string::npos)
+        return;
+
+    auto time = [&](int64_t count)
+    {
+        auto t0 = clock::now();
+        for (int64_t i = 0; i < count; ++i)
+            fn((int)i);
+        return std::chrono::duration<double>(clock::now() - t0).count();
+    };
+
+    int64_t count = 1;
+    while (time(count) < m_min_time && count < ((int64_t)1 << 40))
+        count *= 2;
+
+    std::vector<double> ns;
+    for (int run = 0; run < m_runs; ++run)
+        ns.push_back(time(count) * 1e9 / count);
+
+    result r { name, count, 0, 0, 0, 0 };
+    summarize(r, ns);
+    if (bytes)
+        r.throughput = bytes * 1e9 / r.median;
+
+    printf("%-24s %12.1f ns/op  ±%5.1f%%  (min %.1f, %lld iterations)",
+           name.c_str(), r.median, r.mean > 0 ? 100 * r.stddev / r.mean : 0.0,
+           r.min, (long long)count);
+    if (bytes)
+        printf("  %8.2f MB/s", r.throughput / 1e6);
+    printf("\n");
+    fflush(stdout);
+    m_results.push_back(r);
+}
+
+void bench::summarize(result &r, std::vector<double> &ns)
+{
+    std::sort(ns.begin(), ns.end());
+    r.median = ns[ns.size() / 2];
+    r.min = ns[0];
+    for (double x : ns)
+        r.mean += x / ns.size();
+    for (double x : ns)
+        r.stddev += (x - r.mean) * (x - r.mean) / ns.size();
+    r.stddev = std::sqrt(r.stddev);
+}
+
+void bench::micro()
+{
+    pico8::vm vm;
+    auto &ram = vm.m_ram;
+
+    // Random sprites and map, so that spr() and map() have work to do
+    uint32_t seed = 1;
+    auto rand = [&]() { seed = seed * 1103515245 + 12345; return (uint8_t)(seed >> 16); };
+    for (auto &line : ram.gfx.data)
+        for (auto &p : line)
+            p = rand();
+    for (int n = 0; n < (int)sizeof(ram.map); ++n)
+        ram.map[n] = rand();
+
+    // Pseudo-random coordinates in [-16, 144), so that clipping is exercised
+    auto coord = [](int i, int k) { return (int16_t)((i * 2654435761u >> k) % 160 - 16); };
+    auto color = [](int i) { return opt<fix32>(fix32(i & 15)); };
+
+    measure("cls", [&](int i) { vm.api_cls(i & 15); });
+
+    measure("pset", [&](int i) { vm.api_pset(i & 127, (i >> 7) & 127, color(i)); });
+    measure("pget", [&](int i) { vm.api_pget(i & 127, (i >> 7) & 127); });
+
+    measure("line", [&](int i)
+    {
+        vm.api_line(coord(i, 0), coord(i, 8), coord(i, 16), coord(i, 24), color(i));
+    });
+    measure("line/horizontal", [&](int i)
+    {
+        int16_t y = (int16_t)(i & 127);
+        vm.api_line(0, y, 127, y, color(i));
+    });
+
+    measure("rect", [&](int i)
+    {
+        vm.api_rect(coord(i, 0), coord(i, 8), coord(i, 16), coord(i, 24), color(i));
+    });
+    measure("rectfill", [&](int i)
+    {
+        vm.api_rectfill(coord(i, 0), coord(i, 8), coord(i, 16), coord(i, 24), color(i));
+    });
+    vm.api_fillp(fix32(0x5a5a));
+    measure("rectfill/fillp", [&](int i)
+    {
+        vm.api_rectfill(coord(i, 0), coord(i, 8), coord(i, 16), coord(i, 24), color(i));
+    });
+    vm.api_fillp(fix32(0));
+
+    measure("circ", [&](int i)
+    {
+        vm.api_circ(coord(i, 0), coord(i, 8), (int16_t)(i % 48), color(i));
+    });
+    measure("circfill", [&](int i)
+    {
+        vm.api_circfill(coord(i, 0), coord(i, 8), (int16_t)(i % 48), color(i));
+    });
+    vm.api_fillp(fix32(0x5a5a));
+    measure("circfill/fillp", [&](int i)
+    {
+        vm.api_circfill(coord(i, 0), coord(i, 8), (int16_t)(i % 48), color(i));
+    });
+    vm.api_fillp(fix32(0));
+
+    measure("spr/8x8", [&](int i)
+    {
+        vm.api_spr(i & 255, coord(i, 0), coord(i, 8), opt<fix32>(), opt<fix32>(), false, false);
+    });
+    measure("spr/16x16/flip_x", [&](int i)
+    {
+        vm.api_spr(i & 255, coord(i, 0), coord(i, 8), fix32(2), fix32(2), true, false);
+    });
+    measure("spr/16x16/flip_y", [&](int i)
+    {
+        vm.api_spr(i & 255, coord(i, 0), coord(i, 8), fix32(2), fix32(2), false, true);
+    });
+
+    measure("sspr/upscale", [&](int i)
+    {
+        vm.api_sspr((i & 7) * 16, 0, 16, 16, coord(i, 0), coord(i, 8),
+                    int16_t(64), int16_t(64), false, false);
+    });
+    measure("sspr/downscale", [&](int i)
+    {
+        vm.api_sspr(0, (i & 1) * 64, 64, 64, coord(i, 0), coord(i, 8),
+                    int16_t(16), int16_t(16), false, false);
+    });
+
+    measure("map/full", [&](int i)
+    {
+        vm.api_map((i & 7) * 16, 0, 0, 0, int16_t(16), int16_t(16), 0);
+    });
+    measure("map/partial", [&](int i)
+    {
+        vm.api_map(i & 127, (i >> 7) & 31, coord(i, 0), coord(i, 8), int16_t(4), int16_t(4), 0);
+    });
+
+    pico8::rich_string text;
+    text.assign("hello world 0123");
+    measure("print", [&](int i)
+    {
+        vm.api_print(text, fix32(coord(i, 0)), fix32(i % 110), color(i));
+    });
+
+    measure("memcpy/8k", [&](int i) { vm.api_memcpy(0x6000, (int16_t)((i & 1) * 0x2000), 0x2000); });
+    measure("memset/8k", [&](int i) { vm.api_memset(0x6000, (uint8_t)i, 0x2000); });
+
+    std::vector<lol::u8vec4> rgba(128 * 128);
+    std::vector<uint8_t> indexed(128 * 128);
+    measure("render", [&](int) { vm.render(rgba.data()); });
+    measure("render_indexed", [&](int) { vm.render_indexed(indexed.data()); });
+}
+
+// The input script: one direction held for 15 frames at a time, with
+// O and X pressed now and then. It only depends on the frame number.
+static int script_buttons(int frame)
+{
+    uint32_t x = (uint32_t)(frame / 15 + 1) * 2654435761u;
+    x ^= x >> 15;
+    x *= 2246822519u;
+    x ^= x >> 13;
+
+    int ret = 0;
+    switch (x % 5)
+    {
+        case 0: ret |= 0x1; break;
+        case 1: ret |= 0x2; break;
+        case 2: ret |= 0x4; break;
+        case 3: ret |= 0x8; break;
+        default: break;
+    }
+    if ((x >> 8) % 3 == 0 && frame % 15 < 5)
+        ret |= 0x10;
+    if ((x >> 16) % 4 == 0 && frame % 15 >= 10)
+        ret |= 0x20;
+    return ret;
+}
+
+void bench::carts(std::vector<std::string> const &files, int frames)
+{
+    using clock = std::chrono::steady_clock;
+
+    for (auto const &file : files)
+    {
+        auto name = "cart/" + std::filesystem::path(file).stem().string();
+        if (m_filter.size() && name.find(m_filter) == std::string::npos)
+            continue;
+
+        std::vector<double> ns;
+        pico8::vm::stats stats;
+        int done = frames;
+        bool ok = true;
+
+        // A new VM for each run, so that every run starts from the same
+        // state; only the frames are timed, not the cart loading.
+        for (int run = 0; run < m_runs && ok; ++run)
+        {
+            pico8::vm vm;
+            vm.set_virtual_clock(true);
+            vm.load(file);
+            if (vm.get_code().empty())
+            {
+                lol::msg::error("cannot load %s\n", file.c_str());
+                ok = false;
+                break;
+            }
+            vm.run();
+            vm.set_seed(0);
+            vm.reset_stats();
+
+            auto t0 = clock::now();
+            for (done = 0; done < frames; ++done)
+            {
+                int mask = script_buttons(done);
+                for (int i = 0; i < 6; ++i)
+                    if (mask & (1 << i))
+                        vm.button(i, 1);
+                if (!vm.step(1.f / 60.f))
+                    break;
+            }
+            double t = std::chrono::duration<double>(clock::now() - t0).count();
+            ns.push_back(t * 1e9 / std::max(done, 1));
+            stats = vm.get_stats();
+
+            auto error = vm.get_error();
+            if (error.size())
+                lol::msg::error("%s: %s\n", file.c_str(), error.c_str());
+        }
+
+        if (!ok)
+            continue;
+
+        result r { name, done, 0, 0, 0, 0 };
+        summarize(r, ns);
+        r.instructions = (double)stats.instructions / std::max(done, 1);
+        r.api_calls = (double)stats.api_calls / std::max(done, 1);
+        r.allocs = (double)stats.allocs / std::max(done, 1);
+
+        printf("%-24s %9.3f ms/frame  ±%5.1f%%  %9.0f insn  %7.1f calls  %7.1f allocs  (%d frames)\n",
+               name.c_str(), r.median / 1e6,
+               r.mean > 0 ? 100 * r.stddev / r.mean : 0.0,
+               r.instructions, r.api_calls, r.allocs, done);
+        fflush(stdout);
+        m_results.push_back(r);
+    }
+}
+
+// A cart that exercises all code paths of the codecs: a lot of varied
+// Lua code, and graphics, map, sound and label data.
+static std::string synthetic_p8()
+{
+    uint32_t seed = 1;
+    auto rand = [&](int n) { seed = seed * 1103515245 + 12345; return (int)((seed >> 16) % n); };
+    char const *hex = "0123456789abcdef";
+
+    std::string code;
+    for (int n = 0; code.size() < 40000; ++n)
+    {
+        code += lol::format("function f%d(a, b)\n  local x = a * %d + b\n", n, rand(100));
+        code += lol::format("  for i = 1, %d do\n    x += sin(i / %d) * cos(b)\n  end\n",
+                            rand(20) + 1, rand(50) + 1);
+        code += lol::format("  if x > %d then\n    print(\"value \" .. x, %d, %d, %d)\n  end\n",
+                            rand(1000), rand(128), rand(128), rand(16));
+        code += lol::format("  return flr(x) %% %d\nend\n\n", rand(256) + 1);
+    }
+
+    auto data = [&](int lines, int width, int range)
+    {
+        std::string ret;
+        for (int j = 0; j < lines; ++j, ret += '\n')
+            for (int i = 0; i < width; ++i)
+                ret += hex[rand(range)];
+        return ret;
+    };
+
+    return "pico-8 cartridge // http://www.pico-8.com\nversion 18\n__lua__\n" + code
+         + "__gfx__\n" + data(128, 128, 16) + "__label__\n" + data(128, 128, 16)
+         + "__gff__\n" + data(2, 256, 4) + "__map__\n" + data(32, 256, 8)
+         + "__sfx__\n" + data(64, 168, 16);
+}
+
+void bench::codecs(std::vector<std::string> const &files)
+{
+    namespace fs = std::filesystem;
+
+    // Load all inputs in memory first, so that no benchmark touches the disk
+    std::vector<std::pair<std::string, std::string>> inputs;
+    inputs.push_back(std::make_pair("synthetic", synthetic_p8()));
+    for (auto const &file : files)
+    {
+        mapped_file f;
+        if (f.open(file))
+            inputs.push_back(std::make_pair(fs::path(file).stem().string(),
+                                            std::string(f.view())));
+        else
+            lol::msg::error("cannot load %s\n", file.c_str());
+    }
+
+    for (auto const &input : inputs)
+    {
+        auto prefix = "codec/" + input.first + "/";
+
+        pico8::cart cart;
+        if (!cart.load_p8(input.second))
+        {
+            lol::msg::error("cannot parse %s\n", input.first.c_str());
+            continue;
+        }
+
+        auto const &code = cart.get_code();
+        auto compressed = cart.get_compressed_code();
+        std::vector<uint8_t> bytes(code.begin(), code.end());
+
+        measure(prefix + "load_p8", [&](int) { cart.load_p8(input.second); },
+                input.second.size());
+        measure(prefix + "get_p8", [&](int) { cart.get_p8(); },
+                cart.get_p8().size());
+        measure(prefix + "compress", [&](int) { cart.get_compressed_code(false); },
+                code.size());
+        measure(prefix + "compress/optimal", [&](int) { cart.get_compressed_code(true); },
+                code.size());
+        // The PNG holds the 32 KiB ROM
+        measure(prefix + "get_png", [&](int) { cart.get_png(); }, 0x8000);
+        measure(prefix + "minify", [&](int) { z8::minify(code); },
+                code.size());
+        measure(prefix + "deflate", [&](int) { z8::compress(bytes); },
+                bytes.size());
+        measure(prefix + "encode59", [&](int) { z8::encode59(compressed); },
+                compressed.size());
+
+        // load_png() reads a mapped file, so go through a temporary file
+        auto tmp = fs::temp_directory_path() / ("z8bench-" + input.first + ".p8.png");
+        if (cart.get_png().save(tmp.string()))
+        {
+            mapped_file png;
+            if (png.open(tmp.string()))
+                measure(prefix + "load_png", [&](int) { cart.load_png(png); },
+                        png.size());
+        }
+        std::error_code ec;
+        fs::remove(tmp, ec);
+    }
+
+    // Dither a colour gradient with both algorithms
+    lol::image img(lol::ivec2(128, 128));
+    auto &pixels = img.lock2d<lol::PixelFormat::RGBA_F32>();
+    for (int j = 0; j < 128; ++j)
+        for (int i = 0; i < 128; ++i)
+            pixels[i][j] = lol::vec4(i / 127.f, j / 127.f, (i + j) / 254.f, 1.f);
+    img.unlock2d(pixels);
+
+    measure("codec/dither/ordered", [&](int) { z8::dither(img, false, false); },
+            128 * 128 * sizeof(lol::vec4));
+    measure("codec/dither/diffusion", [&](int) { z8::dither(img, false, true); },
+            128 * 128 * sizeof(lol::vec4));
+}
+
+// The longest match for position i of the code, as found by the brute
+// force search that the hash chains in get_compressed_code() replaced.
+// Matches cannot go past i, and among matches of the same length the
+// farthest one wins.
+static void brute_force_match(std::string const &code, int i, int &best_j, int &best_len)
+{
+    char const *s = code.c_str();
+    int const len = (int)code.size();
+
+    best_j = best_len = 0;
+    for (int j = std::max(i - 3135, 0); j < i; ++j)
+    {
+        int const end = std::min(std::min(len - j, 17), i - j);
+        int k = 0;
+        while (k < end && s[j + k] == s[i + k])
+            ++k;
+        if (k > best_len)
+        {
+            best_j = j;
+            best_len = k;
+        }
+    }
+}
+
+// Decompress with the cart loader, as if the data was read from a ROM
+bool bench::decompresses_to(std::vector<uint8_t> const &data, std::string const &code)
+{
+    pico8::cart tmp;
+    auto &rom = tmp.m_rom.code;
+    if (data.size() + 8 > sizeof(rom) || code.size() > 0xffff)
+        return false;
+
+    uint8_t const header[] = { ':', 'c', ':', '\0', (uint8_t)(code.size() >> 8),
+                               (uint8_t)code.size(), 0, 0 };
+    memset(rom, 0, sizeof(rom));
+    memcpy(rom, header, sizeof(header));
+    memcpy(rom + sizeof(header), data.data(), data.size());
+    tmp.load_code(1);
+    return tmp.m_code == code;
+}
+
+int bench::check_compress(std::vector<std::string> const &files)
+{
+    int failed = 0;
+
+    for (auto const &file : files)
+    {
+        pico8::cart cart;
+        if (!cart.load(file))
+        {
+            lol::msg::error("cannot load %s\n", file.c_str());
+            ++failed;
+            continue;
+        }
+
+        std::string const &code = cart.get_code();
+        auto greedy = cart.get_compressed_code(false);
+        auto optimal = cart.get_compressed_code(true);
+        std::string error;
+
+        if (!decompresses_to(greedy, code))
+            error = "greedy output does not decompress to the code";
+        else if (!decompresses_to(optimal, code))
+            error = "optimal output does not decompress to the code";
+        else if (optimal.size() > greedy.size())
+            error = "optimal output is larger than greedy output";
+
+        // Walk the greedy output and check every decision against the
+        // brute force search: a literal byte is 1 byte, or 2 if escaped
+        // with 0x00; a back reference is 2 bytes starting at 0x3c or more.
+        int pos = 0;
+        for (size_t n = 0; error.empty() && n < greedy.size(); ++n)
+        {
+            int best_j, best_len;
+            brute_force_match(code, pos, best_j, best_len);
+
+            if (greedy[n] >= 0x3c)
+            {
+                int const dist = (greedy[n] - 0x3c) * 16 + (greedy[n + 1] & 0xf);
+                int const len = greedy[n + 1] / 16 + 2;
+                if (best_len < 2 || len != best_len || dist != pos - best_j)
+                    error = lol::format("at byte %d: match (-%d, %d) instead of (-%d, %d)",
+                                        pos, dist, len, pos - best_j, best_len);
+                pos += len;
+                ++n;
+            }
+            else
+            {
+                // A match of 2 is only worth it for an escaped literal
+                bool const escaped = greedy[n] == 0;
+                if (best_len > 2 || (escaped && best_len == 2))
+                    error = lol::format("at byte %d: literal instead of match (-%d, %d)",
+                                        pos, pos - best_j, best_len);
+                pos += 1;
+                n += escaped;
+            }
+        }
+
+        if (error.empty())
+        {
+            printf("%s: ok, %d bytes of code, %d compressed, %d optimal\n", file.c_str(),
+                   (int)code.size(), (int)greedy.size(), (int)optimal.size());
+        }
+        else
+        {
+            printf("%s: FAILED, %s\n", file.c_str(), error.c_str());
+            ++failed;
+        }
+    }
+
+    return failed;
+}
+
+// Compare results with a file written by -o, and return the number of
+// benchmarks that got slower by more than tolerance percent.
+static int compare(std::vector<bench::result> const &results,
+                   char const *filename, double tolerance)
+{
+    FILE *fd = fopen(filename, "r");
+    if (!fd)
+    {
+        lol::msg::error("cannot read %s\n", filename);
+        return -1;
+    }
+
+    std::map<std::string, bench::result> baseline;
+    char line[1024], name[256];
+    while (fgets(line, sizeof(line), fd))
+    {
+        bench::result r { "", 0, 0, 0, 0, 0 };
+        if (sscanf(line, "{\"name\": \"%255[^\"]\", \"median\": %lf", name, &r.median) != 2)
+            continue;
+        if (char const *p = strstr(line, "\"instructions\": "))
+            r.instructions = atof(p + 16);
+        baseline[name] = r;
+    }
+    fclose(fd);
+
+    int slower = 0, faster = 0;
+    printf("\n%-24s %12s %12s %8s\n", "", "baseline", "now", "change");
+    for (auto const &r : results)
+    {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end() || it->second.median <= 0)
+            continue;
+
+        double change = 100 * (r.median - it->second.median) / it->second.median;
+        char const *verdict = "";
+        if (change > tolerance)
+            verdict = "slower", ++slower;
+        else if (change < -tolerance)
+            verdict = "faster", ++faster;
+
+        printf("%-24s %12.1f %12.1f %+7.1f%%  %s", r.name.c_str(),
+               it->second.median, r.median, change, verdict);
+        // The instruction count does not depend on the machine load, so
+        // a change there means the cart really runs different code.
+        if (it->second.instructions > 0 && r.instructions != it->second.instructions)
+            printf("  (insn %+.1f%%)", 100 * (r.instructions - it->second.instructions)
+                                               / it->second.instructions);
+        printf("\n");
+    }
+    printf("%d faster, %d slower, tolerance ±%g%%\n", faster, slower, tolerance);
+
+    return slower;
+}
+
+} // namespace z8
+
+static void usage()
+{
+    printf("Usage: z8bench [--runs <num>] [--time <ms>] [--filter <text>] [-o <file>]\n");
+    printf("               [--carts [--frames <num>] [<cart|dir>...]]\n");
+    printf("               [--codecs [<cart|dir>...]]\n");
+    printf("               [--check-compress [<cart|dir>...]]\n");
+    printf("               [--baseline <file> [--tolerance <percent>]]\n");
+}
+
+int main(int argc, char **argv)
+{
+    lol::sys::init(argc, argv);
+
+    lol::getopt opt(argc, argv);
+    opt.add_opt('h', "help",   false);
+    opt.add_opt('o', "out",    true);
+    opt.add_opt(130, "runs",   true);
+    opt.add_opt(131, "time",   true);
+    opt.add_opt(132, "filter", true);
+    opt.add_opt(133, "carts",  false);
+    opt.add_opt(134, "frames", true);
+    opt.add_opt(135, "baseline",  true);
+    opt.add_opt(136, "tolerance", true);
+    opt.add_opt(137, "codecs", false);
+    opt.add_opt(138, "check-compress", false);
+
+    char const *out = nullptr, *baseline = nullptr;
+    int runs = 7, frames = 600;
+    double min_time = 0.02, tolerance = 5.0;
+    bool carts = false, codecs = false, check_compress = false;
+    std::string filter;
+
+    for (;;)
+    {
+        int c = opt.parse();
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        case 'o':
+            out = opt.arg;
+            break;
+        case 130:
+            runs = std::max(1, atoi(opt.arg));
+            break;
+        case 131:
+            min_time = atof(opt.arg) / 1000;
+            break;
+        case 132:
+            filter = opt.arg;
+            break;
+        case 133:
+            carts = true;
+            break;
+        case 134:
+            frames = std::max(1, atoi(opt.arg));
+            break;
+        case 135:
+            baseline = opt.arg;
+            break;
+        case 136:
+            tolerance = atof(opt.arg);
+            break;
+        case 137:
+            codecs = true;
+            break;
+        case 138:
+            check_compress = true;
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+
+    z8::bench b(runs, min_time, filter);
+    if (carts || codecs || check_compress)
+    {
+        std::vector<std::string> args(argv + opt.index, argv + argc);
+        if (args.empty())
+            args.push_back("carts");
+
+        std::vector<std::string> files;
+        for (auto const &arg : args)
+        {
+            namespace fs = std::filesystem;
+            std::error_code ec;
+            if (!fs::is_directory(arg, ec))
+            {
+                files.push_back(arg);
+                continue;
+            }
+
+            // Only .p8 files: the carts in carts/ also exist as .p8.png
+            std::vector<std::string> found;
+            for (auto const &e : fs::directory_iterator(arg, ec))
+                if (e.is_regular_file(ec) && e.path().extension() == ".p8")
+                    found.push_back(e.path().string());
+            std::sort(found.begin(), found.end());
+            files.insert(files.end(), found.begin(), found.end());
+        }
+
+        // Exit with an error if any cart fails, for use in scripts
+        if (check_compress)
+            return z8::bench::check_compress(files) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+        if (carts)
+            b.carts(files, frames);
+        if (codecs)
+            b.codecs(files);
+    }
+    else
+    {
+        b.micro();
+    }
+
+    // One JSON object per line, easy to parse and to diff
+    if (out)
+    {
+        FILE *fd = fopen(out, "w");
+        if (!fd)
+        {
+            lol::msg::error("cannot write %s\n", out);
+            return EXIT_FAILURE;
+        }
+        for (auto const &r : b.results())
+        {
+            fprintf(fd, "{\"name\": \"%s\", \"median\": %.3f, \"mean\": %.3f, "
+                        "\"stddev\": %.3f, \"min\": %.3f, \"iterations\": %lld",
+                    r.name.c_str(), r.median, r.mean, r.stddev, r.min,
+                    (long long)r.iterations);
+            if (r.instructions > 0 || r.api_calls > 0)
+                fprintf(fd, ", \"instructions\": %.1f, \"api_calls\": %.1f, "
+                            "\"allocs\": %.1f", r.instructions, r.api_calls, r.allocs);
+            if (r.throughput > 0)
+                fprintf(fd, ", \"throughput\": %.0f", r.throughput);
+            fprintf(fd, "}\n");
+        }
+        fclose(fd);
+    }
+
+    // Exit with an error if anything got slower, for use in scripts
+    if (baseline)
+        return z8::compare(b.results(), baseline, tolerance) == 0
+                 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
@@ -20,14 +20,27 @@
 #include <sstream>
 
 #include "zepto8.h"
+#include "file.h"
 #include "player.h"
 #include "raccoon/vm.h"
+#include "trace.h"
 
 int main(int argc, char **argv)
 {
     lol::sys::init(argc, argv);
 
     lol::getopt opt(argc, argv);
+    opt.add_opt(130, "rate",    true);
+    opt.add_opt(131, "quality", true);
+    opt.add_opt(132, "audio-stats", true);
+    opt.add_opt(133, "record",  true);
+    opt.add_opt(134, "replay",  true);
+    opt.add_opt(135, "trace",   true);
+
+    // By default, let the audio backend do the resampling
+    int rate = 0, quality = 2;
+    float audio_stats = 0.f;
+    char const *record = nullptr, *replay = nullptr, *trace = nullptr;
 
     for (;;)
     {
@@ -37,26 +50,60 @@ int main(int argc, char **argv)
 
         switch (c)
         {
+        case 130:
+            rate = atoi(opt.arg);
+            break;
+        case 131:
+            quality = atoi(opt.arg);
+            break;
+        case 132:
+            audio_stats = (float)atof(opt.arg);
+            break;
+        case 133:
+            record = opt.arg;
+            break;
+        case 134:
+            replay = opt.arg;
+            break;
+        case 135:
+            trace = opt.arg;
+            if (!z8::trace::enabled())
+                lol::msg::error("this build has no tracing support, see --enable-trace\n");
+            break;
         default:
             return EXIT_FAILURE;
         }
     }
 
+    char const *cart = opt.index < argc ? argv[opt.index] : nullptr;
+
     lol::ivec2 win_size(144 * 3, 144 * 3);
     lol::Application app("zepto-8", win_size, 60.0f);
 
-    bool is_raccoon = argc >= 2 && lol::ends_with(argv[1], ".rcn.json");
+    // Look at the file contents to know which VM to use
+    z8::mapped_file file;
+    bool is_raccoon = cart && file.open(cart)
+                       && file.format() == z8::file_format::json;
+    file.close();
 
-    z8::player *player = new z8::player(is_raccoon);
+    z8::player *player = new z8::player(is_raccoon, rate, quality);
+    player->show_audio_stats(audio_stats);
+    if (record && !player->record(record))
+        lol::msg::error("cannot create %s\n", record);
+    if (replay && !player->replay(replay))
+        lol::msg::error("cannot open %s\n", replay);
 
-    if (argc >= 2)
+    if (cart)
     {
-        player->load(argv[1]);
+        player->load(cart);
         player->run();
     }
 
     app.Run();
 
+    if (trace)
+        z8::trace::flush(trace);
+
     return EXIT_SUCCESS;
 }
 
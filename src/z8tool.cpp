@@ -20,14 +20,28 @@
 #include <sstream>
 #include <iostream>
 #include <streambuf>
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
 
 #include "zepto8.h"
+#include "file.h"
 #include "pico8/vm.h"
 #include "telnet.h"
 #include "splore.h"
+#include "cart_index.h"
+#include "png.h"
+#include "analyzer.h"
 #include "dither.h"
 #include "minify.h"
 #include "compress.h"
+#include "resampler.h"
+#include "threadpool.h"
+#include "replay.h"
+#include "trace.h"
+#include "wav.h"
 
 enum class mode
 {
@@ -40,12 +54,14 @@ enum class mode
     dither   = 135,
     minify   = 136,
     compress = 137,
+    render   = 138,
 
     tolua  = 140,
     topng  = 141,
     top8   = 143,
     tobin  = 144,
     todata = 145,
+    torom  = 146,
 
     out     = 'o',
     data    = 150,
@@ -53,21 +69,443 @@ enum class mode
     error_diffusion = 152,
     raw     = 153,
     skip    = 154,
+    rate    = 155,
+    frames  = 156,
+    pcm     = 157,
+    export_frames = 158,
+    quality = 159,
+    audio_stats = 160,
+    optimal = 161,
+    batch   = 162,
+    jobs    = 163,
+    index   = 164,
+    query   = 165,
+    input   = 166,
+    seed    = 167,
+    hash    = 168,
+    record  = 169,
+    replay  = 170,
+    draw_interval = 171,
+    trace   = 172,
+    profile = 173,
+    heatmap = 174,
+    profile_period = 175,
 };
 
 static void usage()
 {
-    printf("Usage: z8tool [--tolua|--topng|--top8|--tobin|--todata] [--data <file>] <cart> [-o <file>]\n");
+    printf("Usage: z8tool [--tolua|--topng|--top8|--tobin|--torom|--todata] [--data <file>] [--optimal] <cart> [-o <file>]\n");
+    printf("       z8tool --tolua|--topng|--top8|--tobin|--torom --batch [--jobs <num>] [--optimal] <cart|dir|->... -o <dir>\n");
     printf("       z8tool --dither [--hicolor] [--error-diffusion] <image> [-o <file>]\n");
     printf("       z8tool --minify\n");
     printf("       z8tool --compress [--raw <num>] [--skip <num>]\n");
-    printf("       z8tool --run <cart>\n");
-    printf("       z8tool --inspect <cart>\n");
-    printf("       z8tool --headless <cart>\n");
+    printf("       z8tool --batch --headless <cart|dir|->... [--jobs <num>] [--frames <num>] [--seed <num>] [--draw-interval <num>]\n");
+    printf("       z8tool --run [--record <file>|--replay <file>] [--trace <file>] <cart>\n");
+    printf("       z8tool --inspect [--optimal] <cart>\n");
+    printf("       z8tool --headless [--frames <num>] [--input <file>] [--seed <num>] [--record <file>|--replay <file>] [--draw-interval <num>] [--hash] [--audio-stats] [--trace <file>] [--profile <file>] [--heatmap <file>] [--profile-period <num>] <cart>\n");
+    printf("       z8tool --render <cart> [--rate <hz>] [--quality <0-4>] [--frames <num>] [--pcm] [--export-frames <pattern>] [-o <file>]\n");
 #if HAVE_UNISTD_H
-    printf("       z8tool --telnet <cart>\n");
+    printf("       z8tool --telnet [--record <file>|--replay <file>] <cart>\n");
 #endif
     printf("       z8tool --splore <image>\n");
+    printf("       z8tool --index <file> [--jobs <num>] <cart|dir>...\n");
+    printf("       z8tool --query <file> [<text>]\n");
+}
+
+// Print code and data statistics for a cart
+static void inspect(z8::pico8::cart const &cart, bool optimal)
+{
+    auto const &rom = cart.get_rom();
+    auto const info = z8::analyzer::count(cart.get_code());
+    int const compressed = (int)cart.get_compressed_code(optimal).size();
+
+    // A sprite is used if any of its pixels is non-zero
+    int sprites = 0;
+    for (int n = 0; n < 256; ++n)
+    {
+        bool used = false;
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 4; ++x)
+                used |= rom.gfx.data[n / 16 * 8 + y][n % 16 * 4 + x] != 0;
+        sprites += used;
+    }
+
+    // Only count the map area that does not overlap with gfx
+    int cells = 0;
+    for (int n = 0; n < (int)sizeof(rom.map); ++n)
+        cells += rom.map[n] != 0;
+
+    // An SFX is used if any of its notes has a non-zero volume
+    int sfx = 0;
+    for (auto const &s : rom.sfx)
+    {
+        bool used = false;
+        for (auto const &note : s.notes)
+            used |= ((note[1] >> 1) & 0x7) != 0;
+        sfx += used;
+    }
+
+    // A music pattern is used if any of its channels is enabled; a blank
+    // pattern has all channels enabled on SFX 0, so also ignore those.
+    int patterns = 0;
+    for (auto const &song : rom.song)
+    {
+        bool enabled = false, blank = true;
+        for (int i = 0; i < 4; ++i)
+        {
+            enabled |= (song.sfx(i) & 0x40) == 0;
+            blank &= song.data[i] == 0;
+        }
+        patterns += enabled && !blank;
+    }
+
+    printf("Code chars: %d/65535\n", info.chars);
+    printf("Tokens: %d/8192\n", info.tokens);
+    printf("Compressed code size: %d/%d\n", compressed, (int)sizeof(rom.code) - 8);
+    printf("Sprites: %d/256\n", sprites);
+    printf("Map cells: %d/%d\n", cells, (int)sizeof(rom.map));
+    printf("SFX: %d/64\n", sfx);
+    printf("Music patterns: %d/64\n", patterns);
+
+    if (info.functions.size())
+    {
+        printf("Largest functions:\n");
+        for (size_t i = 0; i < info.functions.size() && i < 10; ++i)
+        {
+            auto const &f = info.functions[i];
+            printf("%6d tokens  %s (line %d)\n", f.tokens, f.name.c_str(), f.line);
+        }
+    }
+}
+
+// Load a scripted input file. Each line is “<frame> <mask>” where mask
+// is a 16-bit btn() value (decimal or 0x hexadecimal); the buttons stay
+// in that state until the next line. Lines starting with # are ignored.
+static bool load_input(char const *filename, std::vector<std::pair<int, int>> &events)
+{
+    std::ifstream f(filename);
+    if (!f)
+        return false;
+
+    for (std::string line; std::getline(f, line); )
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        char *end;
+        long frame = strtol(line.c_str(), &end, 10);
+        long mask = strtol(end, &end, 0);
+        if (end == line.c_str())
+            continue;
+        events.push_back(std::make_pair((int)frame, (int)mask & 0xffff));
+    }
+
+    std::stable_sort(events.begin(), events.end(),
+                     [](auto const &a, auto const &b) { return a.first < b.first; });
+    return true;
+}
+
+// Find all the cartridges in a list of files and directories; "-" reads
+// more names from the standard input, one per line.
+static std::vector<std::string> find_carts(std::vector<std::string> const &args)
+{
+    namespace fs = std::filesystem;
+    std::vector<std::string> ret;
+
+    for (auto const &arg : args)
+    {
+        std::error_code ec;
+        if (arg == "-")
+        {
+            for (std::string line; std::getline(std::cin, line); )
+                if (line.size())
+                    ret.push_back(line);
+        }
+        else if (fs::is_directory(arg, ec))
+        {
+            std::vector<std::string> found;
+            for (auto const &e : fs::recursive_directory_iterator(arg, ec))
+            {
+                auto ext = e.path().extension();
+                if (e.is_regular_file(ec) && (ext == ".p8" || ext == ".png" || ext == ".rom"))
+                    found.push_back(e.path().string());
+            }
+            std::sort(found.begin(), found.end());
+            ret.insert(ret.end(), found.begin(), found.end());
+        }
+        else
+        {
+            ret.push_back(arg);
+        }
+    }
+
+    return ret;
+}
+
+static bool write_file(std::string const &path, void const *data, size_t size)
+{
+    FILE *fd = fopen(path.c_str(), "wb");
+    if (!fd)
+        return false;
+    bool ret = fwrite(data, 1, size, fd) == size;
+    return fclose(fd) == 0 && ret;
+}
+
+// Convert many cartridges at once, each one on its own pool task. Every
+// task does the whole load → convert → write sequence, so that file I/O
+// and CPU work of different carts overlap.
+static int run_batch(mode run_mode, std::vector<std::string> const &args,
+                     char const *out, int jobs, bool optimal)
+{
+    namespace fs = std::filesystem;
+    using clock = std::chrono::steady_clock;
+
+    char const *ext = run_mode == mode::tolua ? ".lua"
+                    : run_mode == mode::topng ? ".p8.png"
+                    : run_mode == mode::top8 ? ".p8"
+                    : run_mode == mode::tobin ? ".bin"
+                    : run_mode == mode::torom ? ".rom" : nullptr;
+    if (!ext || !out)
+    {
+        lol::msg::error("batch mode needs a conversion mode and an output directory\n");
+        return EXIT_FAILURE;
+    }
+
+    std::error_code ec;
+    fs::create_directories(out, ec);
+
+    auto carts = find_carts(args);
+
+    struct timing
+    {
+        bool ok = false;
+        double load = 0, convert = 0, write = 0;
+    };
+    std::vector<timing> timings(carts.size());
+
+    auto ms = [](clock::time_point a, clock::time_point b)
+    {
+        return std::chrono::duration<double, std::milli>(b - a).count();
+    };
+
+    // Strip all known cartridge extensions, e.g. “foo.p8.png” → “foo”,
+    // unless two carts would then be written to the same file, such as
+    // “foo.p8” and “foo.p8.png”; those keep their full file name. Carts
+    // that still clash, e.g. from different directories, are not
+    // converted rather than having several threads write the same file.
+    std::vector<std::string> dsts(carts.size());
+    std::map<std::string, int> uses;
+    for (size_t i = 0; i < carts.size(); ++i)
+    {
+        fs::path name = fs::path(carts[i]).filename();
+        while (name.has_extension() && (name.extension() == ".png" ||
+               name.extension() == ".p8" || name.extension() == ".rom"))
+            name = name.stem();
+        dsts[i] = (fs::path(out) / name).string() + ext;
+        ++uses[dsts[i]];
+    }
+
+    std::map<std::string, size_t> owners;
+    for (size_t i = 0; i < carts.size(); ++i)
+    {
+        if (uses[dsts[i]] > 1)
+            dsts[i] = (fs::path(out) / fs::path(carts[i]).filename()).string() + ext;
+
+        auto owner = owners.emplace(dsts[i], i);
+        if (!owner.second)
+        {
+            lol::msg::error("%s: same output file as %s, skipping\n",
+                            carts[i].c_str(), carts[owner.first->second].c_str());
+            dsts[i].clear();
+        }
+    }
+
+    auto t0 = clock::now();
+    z8::thread_pool pool(jobs);
+    z8::parallel_for(pool, carts.size(), [&](size_t i)
+    {
+        std::string const &dst = dsts[i];
+        if (dst.empty())
+            return;
+
+        timing &t = timings[i];
+        auto t1 = clock::now();
+        z8::pico8::cart cart;
+        if (!cart.load(carts[i]))
+            return;
+
+        auto t2 = clock::now();
+        bool ok = false;
+        auto t3 = t2;
+        if (run_mode == mode::topng)
+        {
+            auto img = cart.get_png(optimal);
+            t3 = clock::now();
+            std::lock_guard<std::mutex> lock(z8::image_lock());
+            ok = img.save(dst);
+        }
+        else
+        {
+            bool is_text = run_mode == mode::tolua || run_mode == mode::top8;
+            std::vector<uint8_t> bin;
+            std::string text;
+            if (run_mode == mode::tolua)
+                text = cart.get_lua();
+            else if (run_mode == mode::top8)
+                text = cart.get_p8();
+            else
+                bin = cart.get_bin(optimal);
+            // A raw ROM is the binary cart without the trailing version byte
+            if (run_mode == mode::torom)
+                bin.resize(sizeof(z8::pico8::memory));
+            t3 = clock::now();
+            ok = is_text ? write_file(dst, text.data(), text.size())
+                         : write_file(dst, bin.data(), bin.size());
+        }
+
+        auto t4 = clock::now();
+        t.ok = ok;
+        t.load = ms(t1, t2);
+        t.convert = ms(t2, t3);
+        t.write = ms(t3, t4);
+    });
+    double total = ms(t0, clock::now());
+
+    // Report in input order, once everything is done
+    int failed = 0;
+    timing sum;
+    for (size_t i = 0; i < carts.size(); ++i)
+    {
+        auto const &t = timings[i];
+        if (!t.ok)
+        {
+            printf("%s: failed\n", carts[i].c_str());
+            ++failed;
+            continue;
+        }
+        printf("%s: load %.2f ms, convert %.2f ms, write %.2f ms\n",
+               carts[i].c_str(), t.load, t.convert, t.write);
+        sum.load += t.load;
+        sum.convert += t.convert;
+        sum.write += t.write;
+    }
+
+    printf("%d carts (%d failed) in %.2f s with %d threads, %.1f carts/s\n"
+           "total time: load %.2f s, convert %.2f s, write %.2f s\n",
+           (int)carts.size(), failed, total / 1000, pool.size(),
+           total > 0 ? carts.size() * 1000 / total : 0.0,
+           sum.load / 1000, sum.convert / 1000, sum.write / 1000);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Paths and cart output are not guaranteed to be valid UTF-8, so keep
+// the JSON pure ASCII: every byte outside 0x20—0x7e becomes one \u00xx
+// escape, which lets readers recover the original bytes.
+static std::string json_string(std::string const &str)
+{
+    std::string ret = "\"";
+    for (uint8_t ch : str)
+    {
+        if (ch == '"' || ch == '\\')
+            ret += '\\';
+        if (ch < 0x20 || ch >= 0x7f)
+            ret += lol::format("\\u%04x", ch);
+        else
+            ret += (char)ch;
+    }
+    return ret + "\"";
+}
+
+// Run many cartridges headless at once, one VM per pool task. Each VM
+// has its own Lua state and memory, so tasks share nothing. Results are
+// printed as JSON lines in completion order, as soon as they are known;
+// printh() output is captured per cart and included in its line rather
+// than mixed with the results.
+static int run_headless_batch(std::vector<std::string> const &args, int jobs,
+                              int frames, bool has_seed, int seed, int draw_interval)
+{
+    auto carts = find_carts(args);
+    if (frames < 0)
+        frames = 60 * 60;
+
+    std::mutex lock;
+    int failed = 0;
+    int64_t total_frames = 0;
+
+    lol::timer total;
+    z8::thread_pool pool(jobs);
+    z8::parallel_for(pool, carts.size(), [&](size_t i)
+    {
+        std::string error, output;
+        uint64_t hash = 0;
+        int frame = 0;
+        lol::timer t;
+
+        z8::pico8::vm vm;
+        vm.set_printh([&output](std::string const &str)
+        {
+            // Do not let a chatty cart use up all the memory
+            size_t const max_output = 0x10000;
+            if (output.size() < max_output)
+                output += str.substr(0, max_output - output.size()) + '\n';
+        });
+        vm.set_virtual_clock(true);
+        vm.set_draw_interval(draw_interval);
+        vm.load(carts[i]);
+        if (vm.get_code().empty())
+        {
+            error = "cannot load cart";
+        }
+        else
+        {
+            vm.run();
+            if (has_seed)
+                vm.set_seed(seed);
+
+            // Only count frames that completed; step() returns false
+            // when the cart stopped during that frame. The last frame is
+            // always drawn, because it is used for the hash; a 30 fps cart
+            // may need one more frame for the draw to actually happen, and
+            // a cart without _draw() never consumes the request.
+            for (int n = 0; n < frames || (n == frames && vm.draw_pending()); ++n)
+            {
+                if (n == frames - 1)
+                    vm.request_draw();
+                if (!vm.step(1.f / 60.f))
+                    break;
+                ++frame;
+            }
+
+            error = vm.get_error();
+            auto ram = vm.ram();
+            hash = z8::fnv1a(std::get<0>(ram) + offsetof(z8::pico8::memory, screen),
+                             sizeof(z8::pico8::memory::screen));
+        }
+        double seconds = t.poll();
+
+        std::string line = lol::format("{\"cart\": %s, \"frames\": %d, "
+                                       "\"seconds\": %.3f, \"fps\": %.1f, "
+                                       "\"hash\": \"%016llx\", \"error\": %s, "
+                                       "\"output\": %s}\n",
+                                       json_string(carts[i]).c_str(), frame, seconds,
+                                       seconds > 0 ? frame / seconds : 0.0,
+                                       (unsigned long long)hash,
+                                       error.empty() ? "null" : json_string(error).c_str(),
+                                       json_string(output).c_str());
+
+        std::lock_guard<std::mutex> guard(lock);
+        fwrite(line.data(), 1, line.size(), stdout);
+        fflush(stdout);
+        failed += !error.empty();
+        total_frames += frame;
+    });
+    double seconds = total.poll();
+
+    lol::msg::info("%d carts (%d failed), %lld frames in %.2f s with %d threads, %.1f fps\n",
+                   (int)carts.size(), failed, (long long)total_frames, seconds,
+                   pool.size(), seconds > 0 ? total_frames / seconds : 0.0);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int main(int argc, char **argv)
@@ -82,29 +520,67 @@ int main(int argc, char **argv)
     opt.add_opt(int(mode::compress), "compress", false);
     opt.add_opt(int(mode::inspect),  "inspect",  true);
     opt.add_opt(int(mode::headless), "headless", true);
+    opt.add_opt(int(mode::render),   "render",   true);
     opt.add_opt(int(mode::tolua),    "tolua",    false);
     opt.add_opt(int(mode::topng),    "topng",    false);
     opt.add_opt(int(mode::top8),     "top8",     false);
     opt.add_opt(int(mode::tobin),    "tobin",    false);
     opt.add_opt(int(mode::todata),   "todata",   false);
+    opt.add_opt(int(mode::torom),    "torom",    false);
     opt.add_opt(int(mode::out),      "out",      true);
     opt.add_opt(int(mode::data),     "data",     true);
     opt.add_opt(int(mode::hicolor),  "hicolor",  false);
     opt.add_opt(int(mode::raw),      "raw",      true);
     opt.add_opt(int(mode::skip),     "skip",     true);
+    opt.add_opt(int(mode::rate),     "rate",     true);
+    opt.add_opt(int(mode::quality),  "quality",  true);
+    opt.add_opt(int(mode::frames),   "frames",   true);
+    opt.add_opt(int(mode::audio_stats), "audio-stats", false);
+    opt.add_opt(int(mode::optimal),  "optimal",  false);
+    opt.add_opt(int(mode::batch),    "batch",    false);
+    opt.add_opt(int(mode::jobs),     "jobs",     true);
+    opt.add_opt(int(mode::pcm),      "pcm",      false);
+    opt.add_opt(int(mode::export_frames), "export-frames", true);
+    opt.add_opt(int(mode::input),    "input",    true);
+    opt.add_opt(int(mode::seed),     "seed",     true);
+    opt.add_opt(int(mode::hash),     "hash",     false);
+    opt.add_opt(int(mode::record),   "record",   true);
+    opt.add_opt(int(mode::replay),   "replay",   true);
+    opt.add_opt(int(mode::draw_interval), "draw-interval", true);
+    opt.add_opt(int(mode::trace),    "trace",    true);
+    opt.add_opt(int(mode::profile),  "profile",  true);
+    opt.add_opt(int(mode::heatmap),  "heatmap",  true);
+    opt.add_opt(int(mode::profile_period), "profile-period", true);
     opt.add_opt(int(mode::error_diffusion), "error-diffusion", false);
 #if HAVE_UNISTD_H
     opt.add_opt(int(mode::telnet),   "telnet",   true);
 #endif
     opt.add_opt(int(mode::splore),   "splore",   true);
+    opt.add_opt(int(mode::index),    "index",    true);
+    opt.add_opt(int(mode::query),    "query",    true);
 
     mode run_mode = mode::none;
     char const *data = nullptr;
     char const *in = nullptr;
     char const *out = nullptr;
+    char const *export_frames = nullptr;
+    char const *input = nullptr;
+    char const *record = nullptr;
+    char const *replay = nullptr;
+    char const *trace = nullptr;
+    char const *profile = nullptr;
+    char const *heatmap = nullptr;
     size_t raw = 0, skip = 0;
+    int rate = 22050, quality = -1, frames = -1, jobs = 0, seed = 0;
+    int draw_interval = 1, profile_period = 1000;
+    bool has_seed = false;
+    bool hash = false;
     bool hicolor = false;
     bool error_diffusion = false;
+    bool pcm = false;
+    bool audio_stats = false;
+    bool optimal = false;
+    bool batch = false;
 
     for (;;)
     {
@@ -119,10 +595,13 @@ int main(int argc, char **argv)
             return EXIT_SUCCESS;
         case (int)mode::run:
         case (int)mode::headless:
+        case (int)mode::render:
         case (int)mode::inspect:
         case (int)mode::dither:
         case (int)mode::telnet:
         case (int)mode::splore:
+        case (int)mode::index:
+        case (int)mode::query:
             run_mode = mode(c);
             in = opt.arg;
             break;
@@ -133,6 +612,7 @@ int main(int argc, char **argv)
         case (int)mode::top8:
         case (int)mode::tobin:
         case (int)mode::todata:
+        case (int)mode::torom:
             run_mode = mode(c);
             break;
         case (int)mode::data:
@@ -153,39 +633,103 @@ int main(int argc, char **argv)
         case (int)mode::error_diffusion:
             error_diffusion = true;
             break;
+        case (int)mode::rate:
+            rate = atoi(opt.arg);
+            break;
+        case (int)mode::quality:
+            quality = atoi(opt.arg);
+            break;
+        case (int)mode::frames:
+            frames = atoi(opt.arg);
+            break;
+        case (int)mode::pcm:
+            pcm = true;
+            break;
+        case (int)mode::audio_stats:
+            audio_stats = true;
+            break;
+        case (int)mode::optimal:
+            optimal = true;
+            break;
+        case (int)mode::batch:
+            batch = true;
+            break;
+        case (int)mode::jobs:
+            jobs = atoi(opt.arg);
+            break;
+        case (int)mode::export_frames:
+            export_frames = opt.arg;
+            break;
+        case (int)mode::input:
+            input = opt.arg;
+            break;
+        case (int)mode::seed:
+            seed = atoi(opt.arg);
+            has_seed = true;
+            break;
+        case (int)mode::hash:
+            hash = true;
+            break;
+        case (int)mode::record:
+            record = opt.arg;
+            break;
+        case (int)mode::replay:
+            replay = opt.arg;
+            break;
+        case (int)mode::draw_interval:
+            draw_interval = atoi(opt.arg);
+            break;
+        case (int)mode::profile:
+            profile = opt.arg;
+            break;
+        case (int)mode::heatmap:
+            heatmap = opt.arg;
+            break;
+        case (int)mode::profile_period:
+            profile_period = atoi(opt.arg);
+            break;
+        case (int)mode::trace:
+            trace = opt.arg;
+            if (!z8::trace::enabled())
+                lol::msg::error("this build has no tracing support, see --enable-trace\n");
+            break;
         default:
             return EXIT_FAILURE;
         }
     }
 
+    if (batch)
+    {
+        std::vector<std::string> args(argv + opt.index, argv + argc);
+        // --headless takes the first cart as its argument
+        if (run_mode == mode::headless)
+        {
+            args.insert(args.begin(), in);
+            return run_headless_batch(args, jobs, frames, has_seed, seed, draw_interval);
+        }
+        return run_batch(run_mode, args, out, jobs, optimal);
+    }
+
     if (!in)
         in = argv[opt.index];
 
     if (run_mode == mode::tolua || run_mode == mode::top8 ||
         run_mode == mode::tobin || run_mode == mode::topng ||
-        run_mode == mode::todata || run_mode == mode::inspect)
+        run_mode == mode::todata || run_mode == mode::torom ||
+        run_mode == mode::inspect)
     {
         z8::pico8::cart cart;
         cart.load(in);
 
         if (data)
         {
-            std::string s;
-            lol::File f;
-            for (auto const &candidate : lol::sys::get_path_list(data))
+            z8::mapped_file f;
+            if (f.open(data))
             {
-                f.Open(candidate, lol::FileAccess::Read);
-                if (f.IsValid())
-                {
-                    s = f.ReadString();
-                    f.Close();
-
-                    lol::msg::debug("loaded file %s (%d bytes, max %d)\n",
-                                    candidate.c_str(), int(s.length()), 0x4300);
-                    break;
-                }
+                lol::msg::debug("loaded data (%d bytes, max %d)\n",
+                                int(f.size()), 0x4300);
+                memcpy(&cart.get_rom(), f.data(), lol::min(int(f.size()), 0x4300));
             }
-            memcpy(&cart.get_rom(), s.c_str(), lol::min(int(s.length()), 0x4300));
         }
 
         if (run_mode == mode::tolua)
@@ -198,14 +742,20 @@ int main(int argc, char **argv)
         }
         else if (run_mode == mode::tobin)
         {
-            auto const &bin = cart.get_bin();
-            fwrite(&bin, 1, sizeof(bin), stdout);
+            auto const &bin = cart.get_bin(optimal);
+            fwrite(bin.data(), 1, bin.size(), stdout);
+        }
+        else if (run_mode == mode::torom)
+        {
+            // A raw ROM is the binary cart without the trailing version byte
+            auto const &bin = cart.get_bin(optimal);
+            fwrite(bin.data(), 1, sizeof(z8::pico8::memory), stdout);
         }
         else if (run_mode == mode::topng)
         {
             if (!out)
                 return EXIT_FAILURE;
-            cart.get_png().save(out);
+            cart.get_png(optimal).save(out);
         }
         else if (run_mode == mode::todata)
         {
@@ -213,25 +763,169 @@ int main(int argc, char **argv)
         }
         else if (run_mode == mode::inspect)
         {
-            printf("Code size: %d\n", (int)cart.get_p8().size());
-            printf("Compressed code size: %d\n", (int)cart.get_compressed_code().size());
+            inspect(cart, optimal);
         }
     }
     else if (run_mode == mode::run || run_mode == mode::headless)
     {
+        bool headless = run_mode == mode::headless;
+
+        std::vector<std::pair<int, int>> events;
+        if (input && !load_input(input, events))
+        {
+            lol::msg::error("cannot load input file %s\n", input);
+            return EXIT_FAILURE;
+        }
+
+        z8::input_writer writer;
+        z8::input_reader reader;
+        if ((record && !writer.open(record)) || (replay && !reader.open(replay)))
+        {
+            lol::msg::error("cannot open input recording %s\n", record ? record : replay);
+            return EXIT_FAILURE;
+        }
+
+        // Headless runs do not depend on the wall clock, so that the same
+        // cart, seed and input always give the same frames.
         z8::pico8::vm vm;
+        vm.set_virtual_clock(headless);
+        vm.set_draw_interval(draw_interval);
+        if (profile || heatmap)
+            vm.enable_profiler(profile_period);
         vm.load(in);
         vm.run();
-        for (bool running = true; running; )
+        if (has_seed)
+            vm.set_seed(seed);
+
+        // With --audio-stats, pull one frame worth of audio per frame
+        // and report the mixer statistics every 5 seconds. Headless runs
+        // are not paced, so only the synthesis times mean anything.
+        vm.set_audio_paced(!headless);
+        auto mixer = vm.get_mixer();
+        std::vector<int16_t> buffer;
+        z8::audio_stats prev;
+        bool running = true;
+        size_t next_event = 0;
+        int buttons = 0, frame = 1;
+        lol::timer total;
+
+        for (; running && (frames < 0 || frame <= frames); ++frame)
         {
             lol::timer t;
+            while (next_event < events.size() && events[next_event].first <= frame)
+                buttons = events[next_event++].second;
+
+            // A replayed recording takes precedence over scripted input
+            if (!reader.is_open() || !reader.next_frame(vm))
+            {
+                for (int i = 0; i < 16; ++i)
+                {
+                    if (buttons & (1 << i))
+                    {
+                        vm.button(i, 1);
+                        writer.button(i, 1);
+                    }
+                }
+                writer.next_frame();
+            }
+
             running = vm.step(1.f / 60.f);
+
+            if (hash)
+            {
+                auto ram = vm.ram();
+                uint64_t h = z8::fnv1a(std::get<0>(ram) + offsetof(z8::pico8::memory, screen),
+                                       sizeof(z8::pico8::memory::screen));
+                printf("frame %d %016llx\n", frame, (unsigned long long)h);
+            }
+            if (audio_stats)
+            {
+                buffer.resize(vm.get_sample_rate() / 60);
+                mixer(buffer.data(), (int)buffer.size() * 2);
+                if (frame % (60 * 5) == 0)
+                {
+                    auto stats = vm.get_audio_stats(true);
+                    lol::msg::info("%s\n", stats.report(prev).c_str());
+                    prev = stats;
+                }
+            }
             if (run_mode == mode::run)
             {
                 vm.print_ansi();
                 t.wait(1.f / 60.f);
             }
         }
+
+        if (headless)
+        {
+            double seconds = total.poll();
+            lol::msg::info("%d frames in %.2f s, %.1f fps\n", frame - 1, seconds,
+                           seconds > 0 ? (frame - 1) / seconds : 0.0);
+        }
+
+        if (trace)
+            z8::trace::flush(trace);
+
+        if (auto profiler = vm.get_profiler())
+        {
+            if (profile && !profiler->save_folded(profile))
+                lol::msg::error("cannot write %s\n", profile);
+            if (heatmap && !profiler->save_lines(heatmap, vm.get_code()))
+                lol::msg::error("cannot write %s\n", heatmap);
+        }
+    }
+    else if (run_mode == mode::render)
+    {
+        // If a resampling quality was given, synthesise at the native
+        // rate and resample the mix; otherwise synthesise at the output rate.
+        z8::pico8::vm vm;
+        if (quality < 0)
+            vm.set_sample_rate(rate);
+        // Rendering runs faster than real time, so time() and stat()
+        // must follow the frame count rather than the wall clock.
+        vm.set_virtual_clock(true);
+        vm.load(in);
+        vm.run();
+
+        z8::wav_writer wav;
+        if (!wav.open(out, rate, 1, pcm))
+            return EXIT_FAILURE;
+
+        // Run as fast as possible, but generate exactly the amount of
+        // audio that would have been played between two frames, so that
+        // exported images and sound stay in sync.
+        auto mixer = vm.get_mixer();
+        z8::resampler resampler(mixer, vm.get_sample_rate(), rate, quality);
+        if (quality >= 0)
+            mixer = resampler.get_streamer();
+        std::vector<int16_t> buffer;
+        lol::image img(lol::ivec2(128, 128));
+        int64_t written = 0;
+
+        if (frames < 0)
+            frames = 60 * 60;
+
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            if (!vm.step(1.f / 60.f))
+                break;
+
+            if (export_frames)
+            {
+                auto pixels = img.lock<lol::PixelFormat::RGBA_8>();
+                vm.render(pixels);
+                img.unlock(pixels);
+                img.save(lol::format(export_frames, frame));
+            }
+
+            int64_t const total = (int64_t)(frame + 1) * rate / 60;
+            buffer.resize(size_t(total - written));
+            mixer(buffer.data(), (int)buffer.size() * 2);
+            wav.write(buffer.data(), buffer.size());
+            written = total;
+        }
+
+        wav.close();
     }
     else if (run_mode == mode::dither)
     {
@@ -270,11 +964,35 @@ int main(int argc, char **argv)
         z8::splore splore;
         splore.dump(in);
     }
+    else if (run_mode == mode::index)
+    {
+        std::vector<std::string> args(argv + opt.index, argv + argc);
+        if (!z8::cart_index::update(in, args, jobs))
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::query)
+    {
+        z8::cart_index index;
+        if (!index.open(in))
+            return EXIT_FAILURE;
+
+        for (size_t n : index.find(opt.index < argc ? argv[opt.index] : ""))
+        {
+            auto const &e = index[n];
+            std::string path = index.str(e.path);
+            if (e.slot != z8::cart_index::no_slot)
+                path += lol::format("#%d", e.slot);
+            printf("%s: \"%s\" by %s (code %d, compressed %d, hash %016llx)\n",
+                   path.c_str(), index.str(e.title), index.str(e.author),
+                   (int)e.code_size, (int)e.compressed_size,
+                   (unsigned long long)e.hash);
+        }
+    }
 #if HAVE_UNISTD_H
     else if (run_mode == mode::telnet)
     {
         z8::telnet telnet;
-        telnet.run(in);
+        telnet.run(in, record, replay);
     }
 #endif
     else
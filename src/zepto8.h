@@ -17,6 +17,8 @@
 #include <string>
 #include <cstddef>
 
+#include "audio_stats.h"
+
 // The ZEPTO-8 types
 // —————————————————
 // Various types and enums that describe ZEPTO-8.
@@ -54,6 +56,17 @@ public:
 
     // Audio streaming
     virtual std::function<void(void *, int)> get_streamer(int channel) = 0;
+    // Mixed output of all channels, as mono S16 at get_sample_rate()
+    virtual std::function<void(void *, int)> get_mixer() = 0;
+    virtual int get_sample_rate() const { return 22050; }
+    // Timing statistics of the mixer callback. With new_period, the
+    // maxima start again from zero after this call.
+    audio_stats get_audio_stats(bool new_period = false)
+    {
+        return new_period ? m_audio_monitor.next_period() : m_audio_monitor.get();
+    }
+    // Set to false when nothing pulls the audio in real time
+    void set_audio_paced(bool paced) { m_audio_monitor.set_paced(paced); }
 
     // IO
     virtual void button(int index, int state) = 0;
@@ -65,7 +78,8 @@ public:
     virtual std::tuple<uint8_t *, size_t> rom() = 0;
 
 protected:
-    std::unique_ptr<pico8::bios> m_bios; // TODO: get rid of this
+    std::shared_ptr<pico8::bios const> m_bios; // TODO: get rid of this
+    audio_monitor m_audio_monitor;
 };
 
 //
@@ -104,6 +118,18 @@ public:
     uint8_t data[H][W / 2];
 };
 
+//
+// 64-bit FNV-1a hash, for content and screen hashes
+//
+
+inline uint64_t fnv1a(void const *data, size_t size,
+                      uint64_t h = 0xcbf29ce484222325ull)
+{
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ ((uint8_t const *)data)[i]) * 0x100000001b3ull;
+    return h;
+}
+
 enum
 {
     PICO8_VERSION = 16,